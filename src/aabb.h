@@ -12,7 +12,20 @@ class aabb {
 		point3 min() const { return minimum; }
 		point3 max() const { return maximum; }
 
-		virtual bool hit(const ray& r, double t_min, double t_max) const;
+		point3 centroid() const { return 0.5 * (minimum + maximum); }
+
+		double surface_area() const {
+			vec3 d = maximum - minimum;
+			return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+		}
+
+		// A box that surrounds nothing. surrounding_box() with any other box returns the other box,
+		// so this is the starting point when growing a box one object at a time.
+		static aabb empty() {
+			return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+		}
+
+		bool hit(const ray& r, double t_min, double t_max) const;
 		/* Original AABB hit method
 		bool hit(const ray& r, double t_min, double t_max) const {
 			for (int a = 0; a < 3; a++)
@@ -51,13 +64,15 @@ inline bool aabb::hit(const ray& r, double t_min, double t_max) const {
 	return true;
 }
 
-aabb surrounding_box(aabb box0, aabb box1) {
-	point3 small(fmin(box0.min().x(), box1.min().x()),
-				 fmin(box0.min().y(), box1.min().y()),
-				 fmin(box0.min().z(), box1.min().z()));
-	point3 big(fmax(box0.max().x(), box1.max().x()),
-				 fmax(box0.max().y(), box1.max().y()),
-				 fmax(box0.max().z(), box1.max().z()));
+// NOTE :: the bvh builders call this tens of millions of times. fmin/fmax end up as library
+//         calls because of their NaN rules, so plain comparisons are used instead.
+inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
+	point3 small(box0.minimum.e[0] < box1.minimum.e[0] ? box0.minimum.e[0] : box1.minimum.e[0],
+				 box0.minimum.e[1] < box1.minimum.e[1] ? box0.minimum.e[1] : box1.minimum.e[1],
+				 box0.minimum.e[2] < box1.minimum.e[2] ? box0.minimum.e[2] : box1.minimum.e[2]);
+	point3 big(box0.maximum.e[0] > box1.maximum.e[0] ? box0.maximum.e[0] : box1.maximum.e[0],
+				 box0.maximum.e[1] > box1.maximum.e[1] ? box0.maximum.e[1] : box1.maximum.e[1],
+				 box0.maximum.e[2] > box1.maximum.e[2] ? box0.maximum.e[2] : box1.maximum.e[2]);
 
 	return aabb(small, big);
 }
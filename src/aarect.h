@@ -9,9 +9,13 @@ class xy_rect : public hittable {
         xy_rect() {}
     
         xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat)
-        : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
+        : xy_rect(_x0, _x1, _y0, _y1, _k, scene_materials().add(mat)) {}
+        xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, material_id mat)
+        : mp(mat), x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k) {}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual void surface(const ray& r, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -22,7 +26,7 @@ class xy_rect : public hittable {
 
 
     public:
-        shared_ptr<material> mp;
+        material_id mp;
         double x0, x1, y0, y1, k;
 };
 
@@ -31,9 +35,13 @@ class xz_rect : public hittable {
     public:
         xz_rect() {}
         xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat)
-        : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+        : xz_rect(_x0, _x1, _z0, _z1, _k, scene_materials().add(mat)) {}
+        xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, material_id mat)
+        : mp(mat), x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k) {}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual void surface(const ray& r, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
             // dimension a small amount.
@@ -48,7 +56,8 @@ class xz_rect : public hittable {
 
 					auto area = (x1 - x0) * (z1 - z0);
 					auto distance_sq = rec.t * rec.t * v.length_squared();
-					auto cosine = fabs(dot(v, rec.normal) / v.length());
+					// The normal is (0, 1, 0), so the dot product is just v.y().
+					auto cosine = fabs(v.y() / v.length());
 
 					return distance_sq / (area * cosine);
 				}
@@ -59,7 +68,7 @@ class xz_rect : public hittable {
 				}
 
     public:
-        shared_ptr<material> mp;
+        material_id mp;
         double x0, x1, z0, z1, k;
 };
 
@@ -69,9 +78,13 @@ class yz_rect : public hittable {
 
         yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
             shared_ptr<material> mat)
-            : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+            : yz_rect(_y0, _y1, _z0, _z1, _k, scene_materials().add(mat)) {}
+        yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, material_id mat)
+            : mp(mat), y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k) {}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual void surface(const ray& r, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
@@ -81,11 +94,12 @@ class yz_rect : public hittable {
         }
 
     public:
-        shared_ptr<material> mp;
+        material_id mp;
         double y0, y1, z0, z1, k;
 };
 
 bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    COUNT_STAT(primitive_tests[stat_rect], 1);
     auto t = (k - r.origin().z()) / r.direction().z();
 
     if (t < t_min || t > t_max)
@@ -97,17 +111,34 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
     
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
+    // Kept as they are; surface() turns them into uvs.
+    rec.u = x;
+    rec.v = y;
     rec.t = t;
-    auto outward_normal = vec3(0, 0, 1);
-    rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
+    rec.object = this;
     return true;
 }
 
+void xy_rect::surface(const ray& r, hit_record& rec) const {
+    rec.u = (rec.u - x0) / (x1 - x0);
+    rec.v = (rec.v - y0) / (y1 - y0);
+    rec.set_face_normal(r, vec3(0, 0, 1));
+    rec.mat_ptr = scene_materials().get(mp);
+    rec.p = r.at(rec.t);
+}
+
+bool xy_rect::occluded(const ray& r, double t_min, double t_max) const {
+    COUNT_STAT(primitive_tests[stat_rect], 1);
+    auto t = (k - r.origin().z()) / r.direction().z();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
 bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    COUNT_STAT(primitive_tests[stat_rect], 1);
     auto t = (k-r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -115,17 +146,33 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t*r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (z-z0)/(z1-z0);
+    rec.u = x;
+    rec.v = z;
     rec.t = t;
-    auto outward_normal = vec3(0, 1, 0);
-    rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
+    rec.object = this;
     return true;
 }
 
+void xz_rect::surface(const ray& r, hit_record& rec) const {
+    rec.u = (rec.u-x0)/(x1-x0);
+    rec.v = (rec.v-z0)/(z1-z0);
+    rec.set_face_normal(r, vec3(0, 1, 0));
+    rec.mat_ptr = scene_materials().get(mp);
+    rec.p = r.at(rec.t);
+}
+
+bool xz_rect::occluded(const ray& r, double t_min, double t_max) const {
+    COUNT_STAT(primitive_tests[stat_rect], 1);
+    auto t = (k-r.origin().y()) / r.direction().y();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t*r.direction().x();
+    auto z = r.origin().z() + t*r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
 bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    COUNT_STAT(primitive_tests[stat_rect], 1);
     auto t = (k-r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -133,14 +180,29 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t*r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y-y0)/(y1-y0);
-    rec.v = (z-z0)/(z1-z0);
+    rec.u = y;
+    rec.v = z;
     rec.t = t;
-    auto outward_normal = vec3(1, 0, 0);
-    rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
+    rec.object = this;
     return true;
 }
 
+void yz_rect::surface(const ray& r, hit_record& rec) const {
+    rec.u = (rec.u-y0)/(y1-y0);
+    rec.v = (rec.v-z0)/(z1-z0);
+    rec.set_face_normal(r, vec3(1, 0, 0));
+    rec.mat_ptr = scene_materials().get(mp);
+    rec.p = r.at(rec.t);
+}
+
+bool yz_rect::occluded(const ray& r, double t_min, double t_max) const {
+    COUNT_STAT(primitive_tests[stat_rect], 1);
+    auto t = (k-r.origin().x()) / r.direction().x();
+    if (t < t_min || t > t_max)
+        return false;
+    auto y = r.origin().y() + t*r.direction().y();
+    auto z = r.origin().z() + t*r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
 #endif
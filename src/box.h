@@ -9,10 +9,16 @@
 class box : public hittable {
     public:
         box() {}
-        box(const point3& p0, const point3& p1, shared_ptr<material>ptr);
+        box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+            : box(p0, p1, scene_materials().add(ptr)) {}
+        box(const point3& p0, const point3& p1, material_id ptr);
 
         virtual bool hit(const ray&r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return sides.occluded(r, t_min, t_max);
+        }
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
             return true;
@@ -24,7 +30,7 @@ class box : public hittable {
         hittable_list sides;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
+box::box(const point3& p0, const point3& p1, material_id ptr) {
     box_min = p0;
     box_max = p1;
 
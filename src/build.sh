@@ -3,6 +3,7 @@
 # Alternatively you can omit the filename and the output file will be named
 # <current_git_branch>.exe
 # Also it uses pushd and popd to build the exe in weekend-raytracing/build/
+# -march=native lets the compiler use AVX for the 8-wide BVH if the CPU has it.
 if [[ -n $1 ]]
 then filename=$1
 else
@@ -10,5 +11,5 @@ else
 fi
 
 pushd ../build
-g++ -pthread ../src/main.cpp -o $filename
+g++ -O2 -march=native -pthread ../src/main.cpp -o $filename
 popd
@@ -4,8 +4,119 @@
 #include "common.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// How a bvh_node decides where to split its objects.
+//   median -- the original method from the book. Pick a random axis and split at the object median.
+//   sah    -- binned surface area heuristic. Try a few split planes on every axis and keep the cheapest one.
+//   lbvh   -- sort by 30 bit Morton code and split where the codes change (see lbvh.h).
+//   lbvh63 -- the same with 63 bit codes, for scenes too big or too spread out for 10 bits per axis.
+//   sbvh   -- SAH that can also cut through objects and put them on both sides (see sbvh.h).
+//             For meshes with long thin triangles.
+// NOTE :: the lbvh and sbvh methods are only implemented by linear_bvh. bvh_node builds a SAH tree for them.
+enum class bvh_method { median, sah, lbvh, lbvh63, sbvh };
+
+inline bool parse_bvh_method(const char* name, bvh_method& method) {
+    if (strcmp(name, "median") == 0)
+        method = bvh_method::median;
+    else if (strcmp(name, "sah") == 0)
+        method = bvh_method::sah;
+    else if (strcmp(name, "lbvh") == 0)
+        method = bvh_method::lbvh;
+    else if (strcmp(name, "lbvh63") == 0)
+        method = bvh_method::lbvh63;
+    else if (strcmp(name, "sbvh") == 0)
+        method = bvh_method::sbvh;
+    else
+        return false;
+    return true;
+}
+
+// Everything the builders need to know about an object, computed once up front
+// so the bounding boxes are not recalculated at every level of the tree.
+// prims[i] describes objects[i]. The builders never move the objects or these structs,
+// they only reorder a vector of indices into them.
+struct bvh_primitive {
+    aabb box;
+    point3 centroid;
+};
+
+// Tuning for the SAH builder. The costs are relative to the cost of testing one object.
+const int sah_bins = 12;
+const int sah_max_leaf_size = 4;
+const double sah_traversal_cost = 0.125;
+
+// Below this many objects a subtree is always built on the current thread.
+const size_t bvh_parallel_threshold = 4096;
+
+// Size of the traversal stacks. Builders have to keep their trees shallower than this.
+const int bvh_max_depth = 128;
+
+// A refit tree gets worse as its objects move away from where they were when it was built.
+// Once its SAH cost is this many times the cost right after the build, rebuild it.
+const double bvh_rebuild_ratio = 1.5;
+
+inline std::vector<bvh_primitive> make_bvh_primitives(const std::vector<shared_ptr<hittable>>& objects, double time0, double time1, int num_threads = 1) {
+    std::vector<bvh_primitive> prims(objects.size());
+
+    auto compute = [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i) {
+            if (!objects[i]->bounding_box(time0, time1, prims[i].box))
+                std::cerr << "No bounding box in bvh_node constructor.\n";
+            prims[i].centroid = prims[i].box.centroid();
+        }
+    };
+
+    if (num_threads <= 1 || objects.size() < bvh_parallel_threshold) {
+        compute(0, objects.size());
+        return prims;
+    }
+
+    task_group group;
+    size_t chunk = (objects.size() + num_threads - 1) / num_threads;
+    for (size_t start = chunk; start < objects.size(); start += chunk) {
+        size_t end = std::min(start + chunk, objects.size());
+        group.run([&compute, start, end]() { compute(start, end); });
+    }
+    compute(0, chunk);
+    group.wait();
+    return prims;
+}
+
+inline std::vector<uint32_t> identity_order(size_t start, size_t end) {
+    std::vector<uint32_t> order(end - start);
+    for (size_t i = start; i < end; ++i)
+        order[i - start] = i;
+    return order;
+}
+
+/*
+ The flattened bvhs (linear_bvh and wide_bvh) can follow moving objects without a rebuild.
+ A refit keeps the tree exactly as it is and only recomputes the boxes, bottom up, from the
+ objects' boxes over the new time interval. That is one cheap pass instead of a build, but
+ the tree was split for where the objects used to be, so it slowly gets worse to traverse.
+ degradation() tracks how much worse, and needs_rebuild() says when it's time to start over.
+*/
+class refittable_bvh : public hittable {
+    public:
+        // Updates every box, using num_threads threads for big trees.
+        virtual void refit(double time0, double time1, int num_threads = 1) = 0;
+
+        // Updates only the boxes above the given objects, which are indices into the
+        // list the tree was built from. The cost is the number of moved objects times
+        // the depth of the tree, not the size of the scene.
+        virtual void refit_objects(double time0, double time1, const std::vector<uint32_t>& moved) = 0;
+
+        // SAH cost of the tree now divided by its cost right after it was built.
+        virtual double degradation() const = 0;
+
+        bool needs_rebuild() const { return degradation() > bvh_rebuild_ratio; }
+};
 
 class bvh_node : public hittable {
     public:
@@ -15,90 +126,215 @@ class bvh_node : public hittable {
             : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
         {}
 
+        bvh_node(const hittable_list& list, double time0, double time1, bvh_method method);
+
         bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1);
 
+        // Builds the subtree for objects[order[start]] ... objects[order[end - 1]], reordering order in place.
+        bvh_node(const std::vector<shared_ptr<hittable>>& objects, const std::vector<bvh_primitive>& prims,
+                 std::vector<uint32_t>& order, size_t start, size_t end, bvh_method method);
+
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
     public:
+        // NOTE :: SAH leaves have a null right child. left is either the single object in the leaf
+        //         or a hittable_list of all of them.
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
         aabb box;
 
 };
 
-// Box comparison functions, used int std::sort
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
-
-    if (!a->bounding_box(-1, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
-
-    return box_a.min().e[axis] < box_b.min().e[axis];
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1) {
+    auto prims = make_bvh_primitives(src_objects, time0, time1);
+    auto order = identity_order(start, end);
+    *this = bvh_node(src_objects, prims, order, 0, order.size(), bvh_method::median);
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+bvh_node::bvh_node(const hittable_list& list, double time0, double time1, bvh_method method) {
+    auto prims = make_bvh_primitives(list.objects, time0, time1);
+    auto order = identity_order(0, list.objects.size());
+    *this = bvh_node(list.objects, prims, order, 0, order.size(), method);
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+// The book's split -- a random axis, cut at the object median.
+// The axis comes from hashing the node's range rather than from random_int(). The build runs
+// on whichever pool threads are free, in no fixed order, and their samplers hold whatever the
+// last render left in them, so drawing from them gave a different tree every run.
+inline void median_split(const std::vector<bvh_primitive>& prims, std::vector<uint32_t>& order, size_t start, size_t end, size_t& mid, int& axis) {
+    axis = static_cast<int>(hash_combine(start, end) % 3);
+    mid = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+        [&prims, axis](uint32_t a, uint32_t b) {
+            return prims[a].box.min()[axis] < prims[b].box.min()[axis];
+        });
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+// The bounds of the objects in order[start, end) and the bounds of their centroids, in one pass.
+inline void range_bounds(const std::vector<bvh_primitive>& prims, const std::vector<uint32_t>& order, size_t start, size_t end,
+                         aabb& bounds, aabb& centroid_bounds) {
+    bounds = aabb::empty();
+    centroid_bounds = aabb::empty();
+    for (size_t i = start; i < end; ++i) {
+        const bvh_primitive& prim = prims[order[i]];
+        bounds = surrounding_box(bounds, prim.box);
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(prim.centroid, prim.centroid));
+    }
 }
 
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1) {
-    auto objects = src_objects;
+// Find the cheapest split of order[start, end) using binned SAH.
+// Returns false if making a leaf is cheaper than any split. Otherwise the objects are partitioned
+// around the split, mid is the first object on the right side and axis is the axis that was split.
+inline bool sah_split(const std::vector<bvh_primitive>& prims, std::vector<uint32_t>& order, size_t start, size_t end,
+                      const aabb& bounds, const aabb& centroid_bounds, size_t& mid, int& axis) {
+    size_t object_span = end - start;
 
-    int axis = random_int(0, 2);
-    auto comparator = (axis == 0 ) ? box_x_compare
-                    : (axis == 1 ) ? box_y_compare
-                                   : box_z_compare;
+    struct bin {
+        aabb box = aabb::empty();
+        int count = 0;
+    };
 
-    size_t object_span = end - start;
+    // Bin every axis in the same pass. Going through order jumps around prims,
+    // so each object should only be looked up once.
+    bin bins[3][sah_bins];
+    double lo[3], scale[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = centroid_bounds.min()[a];
+        double extent = centroid_bounds.max()[a] - lo[a];
+        scale[a] = (extent > 0) ? sah_bins / extent : 0.0;
+    }
 
-    if(object_span == 1) {
-        left = right = objects[start];
-    } else if (object_span == 2) {
-        if(comparator(objects[start], objects[start + 1])) {
-            left = objects[start];
-            right = objects[start+1];
-        } else {
-            left = objects[start+1];
-            right = objects[start];
+    for (size_t i = start; i < end; ++i) {
+        const bvh_primitive& prim = prims[order[i]];
+        for (int a = 0; a < 3; ++a) {
+            int b = static_cast<int>((prim.centroid[a] - lo[a]) * scale[a]);
+            if (b >= sah_bins) b = sah_bins - 1;
+            bins[a][b].count++;
+            bins[a][b].box = surrounding_box(bins[a][b].box, prim.box);
         }
-    } else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
+    }
+
+    double best_cost = infinity;
+    int best_axis = -1;
+    int best_bin = -1;
+
+    for (int a = 0; a < 3; ++a) {
+        if (scale[a] == 0.0)
+            continue;
 
-        auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        // Sweep from the right first so each split plane's cost is a single pass.
+        double right_area[sah_bins - 1];
+        int right_count[sah_bins - 1];
+        aabb right_box = aabb::empty();
+        int count = 0;
+        for (int b = sah_bins - 1; b > 0; --b) {
+            right_box = surrounding_box(right_box, bins[a][b].box);
+            count += bins[a][b].count;
+            right_area[b - 1] = count ? right_box.surface_area() : 0.0;
+            right_count[b - 1] = count;
+        }
+
+        aabb left_box = aabb::empty();
+        count = 0;
+        for (int b = 0; b < sah_bins - 1; ++b) {
+            left_box = surrounding_box(left_box, bins[a][b].box);
+            count += bins[a][b].count;
+            if (count == 0 || right_count[b] == 0)
+                continue;
+            double cost = sah_traversal_cost
+                        + (count * left_box.surface_area() + right_count[b] * right_area[b]) / bounds.surface_area();
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
     }
 
-    aabb box_left, box_right;
+    if (best_axis == -1) {
+        // Every centroid is in the same place so no plane can separate them.
+        // Fall back to splitting down the middle of the list if there are too many for one leaf.
+        if (object_span <= sah_max_leaf_size)
+            return false;
+        mid = start + object_span / 2;
+        axis = 0;
+        return true;
+    }
 
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right-> bounding_box(time0, time1, box_right))
-        std::cerr << "No bounding box in bvh node constructor \n";
+    if (object_span <= sah_max_leaf_size && best_cost >= object_span)
+        return false;
 
-    box = surrounding_box(box_left, box_right);
+    double split_lo = lo[best_axis];
+    double split_scale = scale[best_axis];
+    auto middle = std::partition(order.begin() + start, order.begin() + end,
+        [&prims, best_axis, best_bin, split_lo, split_scale](uint32_t i) {
+            int b = static_cast<int>((prims[i].centroid[best_axis] - split_lo) * split_scale);
+            if (b >= sah_bins) b = sah_bins - 1;
+            return b <= best_bin;
+        });
+    mid = middle - order.begin();
+    axis = best_axis;
+    return true;
 }
 
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& objects, const std::vector<bvh_primitive>& prims,
+                   std::vector<uint32_t>& order, size_t start, size_t end, bvh_method method) {
+    aabb centroid_bounds;
+    range_bounds(prims, order, start, end, box, centroid_bounds);
+
+    // Ranges of one object don't need a node of their own.
+    auto child = [&](size_t child_start, size_t child_end) -> shared_ptr<hittable> {
+        if (child_end - child_start == 1)
+            return objects[order[child_start]];
+        return make_shared<bvh_node>(objects, prims, order, child_start, child_end, method);
+    };
+
+    size_t mid;
+    int axis;
+    if (end - start == 1) {
+        left = objects[order[start]];
+    } else if (method == bvh_method::median) {
+        median_split(prims, order, start, end, mid, axis);
+        left = child(start, mid);
+        right = child(mid, end);
+    } else if (!sah_split(prims, order, start, end, box, centroid_bounds, mid, axis)) {
+        auto leaf = make_shared<hittable_list>();
+        for (size_t i = start; i < end; ++i)
+            leaf->add(objects[order[i]]);
+        left = leaf;
+    } else {
+        left = child(start, mid);
+        right = child(mid, end);
+    }
+}
 
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    COUNT_STAT(node_visits, 1);
     if (! box.hit(r, t_min, t_max))
         return false;
 
+    if (!right)
+        return left->hit(r, t_min, t_max, rec);
+
     bool hit_left = left->hit(r, t_min, t_max, rec);
     bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
 
     return hit_left || hit_right;
 }
 
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    COUNT_STAT(node_visits, 1);
+    if (! box.hit(r, t_min, t_max))
+        return false;
+
+    if (!right)
+        return left->occluded(r, t_min, t_max);
+    return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
+}
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = box;
     return true;
@@ -37,8 +37,12 @@ class camera {
 		}
 
 		ray get_ray(double s, double t) const {
-			vec3 rd = lens_radius * random_in_unit_disk();
-			vec3 offset = u * rd.x() + v * rd.y();
+			// A pinhole camera doesn't use up sampler dimensions on the lens.
+			vec3 offset(0, 0, 0);
+			if (lens_radius > 0) {
+				vec3 rd = lens_radius * random_in_unit_disk();
+				offset = u * rd.x() + v * rd.y();
+			}
 			return ray(
 					origin + offset,
 					lower_left_corner + s * horizontal + t * vertical - origin - offset, random_double(time0, time1)
@@ -6,6 +6,8 @@
 #include <memory>
 #include <cstdlib>
 
+#include "sampler.h"
+
 // Using
 using std::shared_ptr;
 using std::make_shared;
@@ -24,7 +26,7 @@ inline double degrees_to_radians(double degrees)
 inline double random_double()
 {
 	// returns a double in range [0, 1)
-	return rand() / (RAND_MAX + 1.0);
+	return this_thread_sampler().next_double();
 }
 
 inline double random_double(double min, double max)
@@ -10,11 +10,11 @@
 class constant_medium : public hittable {
     public:
         constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
-        : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(a))
+        : boundary(b), phase_function(scene_materials().add(make_shared<isotropic>(a))), neg_inv_density(-1/d)
         {}
 
         constant_medium(shared_ptr<hittable> b, double d, color c)
-        : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<isotropic>(c))
+        : boundary(b), phase_function(scene_materials().add(make_shared<isotropic>(c))), neg_inv_density(-1/d)
         {}
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
@@ -22,14 +22,19 @@ class constant_medium : public hittable {
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             return boundary->bounding_box(time0, time1, output_box);
         }
+
+        virtual bool moves() const override {
+            return boundary->moves();
+        }
     
     public:
         shared_ptr<hittable> boundary;
-        shared_ptr<material> phase_function;
+        material_id phase_function;
         double neg_inv_density;
 };
 
 bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    COUNT_STAT(primitive_tests[stat_medium], 1);
     const bool DEBUG = false;
     const bool debugging = DEBUG && random_double() < 0.00001;
 
@@ -88,7 +93,8 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
     rec.normal = vec3(1, 0, 0); // arbitrary
     rec.front_face = true;      // arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = scene_materials().get(phase_function);
+    rec.object = nullptr;       // already complete
 
     return true;
 };
@@ -0,0 +1,382 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "common.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The start of a framebuffer file. The tiles follow it, from the next page on.
+struct framebuffer_header {
+	char magic[8];
+	uint32_t width, height, tile_size;
+	// 4 for floats, 8 for doubles.
+	uint32_t channel_bytes;
+	// Where the framebuffer's region is in the whole image. Zero in files from before crops,
+	// which always held the whole image.
+	uint32_t image_width, image_height, x0, y0;
+	// Only used by checkpoints, see framebuffer::save_checkpoint().
+	uint64_t settings;
+	uint32_t frame, samples;
+};
+
+const char framebuffer_magic[8] = { 'R', 'T', 'F', 'B', 'U', 'F', '1', 0 };
+
+// How far a progressive render got: every pixel of the frame holds the average of its
+// first samples samples. settings tells renders that would give different pixels apart.
+struct render_progress {
+	uint64_t settings;
+	int frame, samples;
+};
+
+/*
+ The finished pixels of one image, which the render threads write straight into. Each
+ pixel is the average of its samples, linear and not clamped; image_writer.h does the rest.
+ One framebuffer is kept for the whole run and reused by every frame.
+
+ The pixels are stored a tile at a time, in the same reading order as the tiles, and every
+ tile starts on a cache line. A render thread only ever writes inside its own tile, so two
+ threads never touch the same line, and a row of tiles is one contiguous block.
+
+ The pixels either live in memory or in a file mapped into memory. A 32K x 16K poster is
+ 12 GB of doubles, more than the machines have, but in a file only the rows that are being
+ rendered or written need to be in RAM -- once the writer has saved a band of rows,
+ release_band() hands its pages back to the kernel. Channels can be floats instead of
+ doubles, which halves the size again.
+
+ A tile's pixels are all in place once tile_done() says so, which is how the writer can
+ look at the image before the whole render has finished.
+
+ A framebuffer can hold just a region of the image, for a crop. Its pixels still count from
+ its own top left corner, but the tiles are those of the whole image, cut off at the edges of
+ the region, so each one is filled in by exactly one tile of the render.
+*/
+class framebuffer {
+	public:
+		static const size_t cache_line = 64;
+
+		// The whole image. With a filename the pixels go in that file, which is created or overwritten.
+		framebuffer(int width, int height, int tile_size, bool single_precision = false, const char* filename = nullptr)
+			: framebuffer(width, height, { 0, 0, width, height }, tile_size, single_precision, filename) {}
+
+		// Only region of an image_width x image_height image. With keep_file, filename already
+		// holds this framebuffer (see open()), and it is mapped read only -- nothing can be stored.
+		framebuffer(int image_width, int image_height, const image_region& region, int tile_size,
+		            bool single_precision = false, const char* filename = nullptr, bool keep_file = false)
+			: width(region.width()), height(region.height()), tile_size(tile_size),
+			  tiles_per_row((region.x1 - 1) / tile_size - region.x0 / tile_size + 1),
+			  tile_rows((region.y1 - 1) / tile_size - region.y0 / tile_size + 1),
+			  num_tiles(tiles_per_row * tile_rows),
+			  channel_bytes(single_precision ? sizeof(float) : sizeof(double)),
+			  image_width(image_width), image_height(image_height), x0(region.x0), y0(region.y0),
+			  done(new std::atomic<bool>[num_tiles]) {
+			const size_t pixel_bytes = 3 * channel_bytes;
+			tile_bytes = (size_t(tile_size) * tile_size * pixel_bytes + cache_line - 1) / cache_line * cache_line;
+			pixels_bytes = tile_bytes * num_tiles;
+
+			if (filename && !map_file(filename, keep_file)) {
+				if (keep_file)
+					throw std::runtime_error(std::string("could not map the framebuffer file '") + filename + "'");
+				std::cerr << "ERROR: could not map the framebuffer file '" << filename << "', keeping the image in memory.\n";
+			}
+			if (!mapping) {
+				// NOTE :: aligned_alloc wants the size to be a multiple of the alignment, which it is.
+				pixels = static_cast<uint8_t*>(std::aligned_alloc(cache_line, pixels_bytes));
+				if (!pixels)
+					throw std::bad_alloc();
+				// A file starts out as zeros too.
+				memset(pixels, 0, pixels_bytes);
+			}
+			start_frame();
+		}
+
+		~framebuffer() {
+			if (mapping)
+				munmap(mapping, mapping_bytes);
+			else
+				std::free(pixels);
+		}
+
+		framebuffer(const framebuffer&) = delete;
+		framebuffer& operator=(const framebuffer&) = delete;
+
+		// Maps a framebuffer file that an earlier run left behind, pixels and all, read only.
+		// Returns null if it isn't one, or its header doesn't add up.
+		static std::unique_ptr<framebuffer> open(const char* filename) {
+			framebuffer_header header;
+			int fd = ::open(filename, O_RDONLY);
+			if (fd < 0)
+				return nullptr;
+			bool read_all = pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+			close(fd);
+			if (!read_all || memcmp(header.magic, framebuffer_magic, sizeof(header.magic)) != 0 ||
+			    (header.channel_bytes != sizeof(float) && header.channel_bytes != sizeof(double)) ||
+			    header.width == 0 || header.height == 0 || header.tile_size == 0)
+				return nullptr;
+			if (header.image_width == 0) {
+				header.image_width = header.width;
+				header.image_height = header.height;
+			}
+			// The region has to be inside the image, or stitching it would write outside it.
+			if (header.image_width > uint32_t(INT32_MAX) || header.image_height > uint32_t(INT32_MAX) ||
+			    uint64_t(header.x0) + header.width > header.image_width || uint64_t(header.y0) + header.height > header.image_height)
+				return nullptr;
+			image_region region = { int(header.x0), int(header.y0), int(header.x0 + header.width), int(header.y0 + header.height) };
+			try {
+				return std::unique_ptr<framebuffer>(new framebuffer(header.image_width, header.image_height, region, header.tile_size,
+				                                                    header.channel_bytes == sizeof(float), filename, true));
+			} catch (const std::runtime_error&) {
+				return nullptr;
+			}
+		}
+
+		/*
+		 Copies the pixels to filename, in the same format as a framebuffer file, along with how
+		 far the render has got. The copy is written next to filename and renamed over it once
+		 it is all on disk, so a run that is killed while saving still leaves the last
+		 checkpoint whole. Only call this between renders.
+		*/
+		bool save_checkpoint(const char* filename, const render_progress& progress) const {
+			std::string temporary = std::string(filename) + ".tmp";
+			int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+			std::vector<uint8_t> header_page(header_bytes(), 0);
+			framebuffer_header header = make_header();
+			header.settings = progress.settings;
+			header.frame = progress.frame;
+			header.samples = progress.samples;
+			memcpy(header_page.data(), &header, sizeof(header));
+			bool ok = write_all(fd, header_page.data(), header_page.size()) && write_all(fd, pixels, pixels_bytes) && fsync(fd) == 0;
+			ok = close(fd) == 0 && ok;
+			if (ok && rename(temporary.c_str(), filename) == 0)
+				return true;
+			unlink(temporary.c_str());
+			return false;
+		}
+
+		// Reads a checkpoint of this same framebuffer back in, and sets progress.frame and
+		// progress.samples. Returns false if filename isn't one, or is one of a render with
+		// other settings.
+		bool load_checkpoint(const char* filename, render_progress& progress) {
+			int fd = ::open(filename, O_RDONLY);
+			if (fd < 0)
+				return false;
+			framebuffer_header header, mine = make_header();
+			bool ok = pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+			          memcmp(&header, &mine, offsetof(framebuffer_header, settings)) == 0 && header.settings == progress.settings;
+			ok = ok && read_all(fd, pixels, pixels_bytes, header_bytes());
+			close(fd);
+			if (ok) {
+				progress.frame = header.frame;
+				progress.samples = header.samples;
+			}
+			return ok;
+		}
+
+		image_region region() const {
+			return { x0, y0, x0 + width, y0 + height };
+		}
+
+		// x and row count from the top left of the framebuffer, which is only the top left of
+		// the image when it holds all of it.
+		void store(int x, int row, const color& c) {
+			uint8_t* p = pixels + pixel_offset(x, row);
+			if (channel_bytes == sizeof(float)) {
+				float f[3] = { float(c.x()), float(c.y()), float(c.z()) };
+				memcpy(p, f, sizeof(f));
+			} else {
+				memcpy(p, c.e, sizeof(c.e));
+			}
+		}
+
+		color load(int x, int row) const {
+			const uint8_t* p = pixels + pixel_offset(x, row);
+			if (channel_bytes == sizeof(float)) {
+				float f[3];
+				memcpy(f, p, sizeof(f));
+				return color(f[0], f[1], f[2]);
+			}
+			color c;
+			memcpy(c.e, p, sizeof(c.e));
+			return c;
+		}
+
+		// One whole row, put back together from the tiles it crosses.
+		void load_row(int row, color* out) const {
+			for (int x = 0; x < width; ++x)
+				out[x] = load(x, row);
+		}
+
+		// The rows [first, last) that the band-th row of tiles covers.
+		void band_rows(int band, int& first, int& last) const {
+			int top = (y0 / tile_size + band) * tile_size - y0;
+			first = std::max(top, 0);
+			last = std::min(top + tile_size, height);
+		}
+
+		// Drops a row of tiles out of memory once nothing needs it for this frame. It stays
+		// in the file. Only for a mapped file.
+		void release_band(int band) const {
+			if (!mapping)
+				return;
+			const size_t page = sysconf(_SC_PAGESIZE);
+			size_t begin = tile_bytes * band * tiles_per_row;
+			size_t end = tile_bytes * (band + 1) * tiles_per_row;
+			// Only pages that are all inside the rows.
+			uintptr_t from = (reinterpret_cast<uintptr_t>(pixels) + begin + page - 1) / page * page;
+			uintptr_t to = (reinterpret_cast<uintptr_t>(pixels) + end) / page * page;
+			if (from < to)
+				madvise(reinterpret_cast<void*>(from), to - from, MADV_DONTNEED);
+		}
+
+		bool mapped() const { return mapping != nullptr; }
+
+		// Forget which tiles are done before rendering the next frame into it.
+		void start_frame() {
+			for (int i = 0; i < num_tiles; ++i)
+				done[i].store(false, std::memory_order_relaxed);
+			finished.store(0, std::memory_order_relaxed);
+		}
+
+		// Called by the thread that rendered t, a tile of the whole image, after the last of its
+		// pixels is written.
+		void finish_tile(const tile& t) {
+			uint64_t index = uint64_t(t.y0 / tile_size - y0 / tile_size) * tiles_per_row + (t.x0 / tile_size - x0 / tile_size);
+			done[index].store(true, std::memory_order_release);
+			finished.fetch_add(1, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> lock(mutex);
+			tile_finished.notify_all();
+		}
+
+		bool tile_done(uint64_t index) const {
+			return done[index].load(std::memory_order_acquire);
+		}
+
+		int tiles_finished() const {
+			return finished.load(std::memory_order_relaxed);
+		}
+
+		// Blocks until tiles [first, last) are all done. These count from the top left of the
+		// framebuffer.
+		void wait_for_tiles(uint64_t first, uint64_t last) const {
+			std::unique_lock<std::mutex> lock(mutex);
+			tile_finished.wait(lock, [&]() {
+				for (uint64_t i = first; i < last; ++i)
+					if (!tile_done(i))
+						return false;
+				return true;
+			});
+		}
+
+	public:
+		const int width, height, tile_size, tiles_per_row, tile_rows, num_tiles;
+		const size_t channel_bytes;
+		// The whole image, and where the framebuffer is in it.
+		const int image_width, image_height, x0, y0;
+
+	private:
+		static bool write_all(int fd, const uint8_t* data, size_t bytes) {
+			while (bytes > 0) {
+				ssize_t n = write(fd, data, bytes);
+				if (n <= 0)
+					return false;
+				data += n;
+				bytes -= n;
+			}
+			return true;
+		}
+
+		static bool read_all(int fd, uint8_t* data, size_t bytes, off_t offset) {
+			while (bytes > 0) {
+				ssize_t n = pread(fd, data, bytes, offset);
+				if (n <= 0)
+					return false;
+				data += n;
+				bytes -= n;
+				offset += n;
+			}
+			return true;
+		}
+
+		size_t pixel_offset(int x, int row) const {
+			// Where the tiles are cut is decided by the whole image.
+			x += x0;
+			row += y0;
+			uint64_t index = uint64_t(row / tile_size - y0 / tile_size) * tiles_per_row + (x / tile_size - x0 / tile_size);
+			size_t within = size_t(row % tile_size) * tile_size + x % tile_size;
+			return index * tile_bytes + within * 3 * channel_bytes;
+		}
+
+		static size_t header_bytes() {
+			const size_t page = sysconf(_SC_PAGESIZE);
+			return (sizeof(framebuffer_header) + page - 1) / page * page;
+		}
+
+		framebuffer_header make_header() const {
+			framebuffer_header header = {};
+			memcpy(header.magic, framebuffer_magic, sizeof(header.magic));
+			header.width = width;
+			header.height = height;
+			header.tile_size = tile_size;
+			header.channel_bytes = channel_bytes;
+			header.image_width = image_width;
+			header.image_height = image_height;
+			header.x0 = x0;
+			header.y0 = y0;
+			return header;
+		}
+
+		bool map_file(const char* filename, bool keep_file) {
+			int fd = ::open(filename, keep_file ? O_RDONLY : O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				return false;
+			mapping_bytes = header_bytes() + pixels_bytes;
+			void* p = MAP_FAILED;
+			struct stat st;
+			if (keep_file ? fstat(fd, &st) == 0 && size_t(st.st_size) == mapping_bytes : ftruncate(fd, mapping_bytes) == 0)
+				p = mmap(nullptr, mapping_bytes, keep_file ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			// The mapping keeps the file open.
+			close(fd);
+			if (p == MAP_FAILED)
+				return false;
+
+			mapping = static_cast<uint8_t*>(p);
+			pixels = mapping + header_bytes();
+			if (!keep_file) {
+				framebuffer_header header = make_header();
+				memcpy(mapping, &header, sizeof(header));
+			}
+			return true;
+		}
+
+		size_t tile_bytes, pixels_bytes;
+		uint8_t* pixels = nullptr;
+		uint8_t* mapping = nullptr;
+		size_t mapping_bytes = 0;
+		std::unique_ptr<std::atomic<bool>[]> done;
+		std::atomic<int> finished{0};
+		mutable std::mutex mutex;
+		mutable std::condition_variable tile_finished;
+};
+
+#endif
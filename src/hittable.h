@@ -4,32 +4,80 @@
 #include "ray.h"
 #include "common.h"
 #include "aabb.h"
+#include "material_table.h"
+#include "ray_stats.h"
 
-class material;
+class hittable;
 
+/*
+ hit() only fills in t, object and whatever the object needs to find the hit again
+ (u and v hold those until then). Most of the hits found while looking for the
+ closest one get thrown away, so the point, normal, uv and material are filled in
+ by resolve() once the closest hit is known.
+*/
 struct hit_record {
 	point3 p;
 	vec3 normal;
-	shared_ptr<material> mat_ptr;
+	const material* mat_ptr;  // owned by scene_materials()
 	double t;
 	double u;
 	double v;
 	bool front_face;
+	const hittable* object = nullptr;
 
 	inline void set_face_normal(const ray& r, const vec3& outward_normal) {
 		front_face = dot(r.direction(), outward_normal) < 0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
+
+	// r has to be the ray that was passed to hit().
+	inline void resolve(const ray& r);
 };
 
 class hittable {
 	public:
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+		// Fills in the rest of rec for a hit this object recorded. Objects that fill in the
+		// whole record in hit() leave rec.object null and don't need this.
+		virtual void surface(const ray& r, hit_record& rec) const {}
+
+		// Does the ray hit anything between t_min and t_max? Shadow rays only need to know that,
+		// not which hit is closest or what it looks like, so this can stop at the first hit and
+		// skips the normal, uv and material. Shapes should override it; this is just a fallback.
+		virtual bool occluded(const ray& r, double t_min, double t_max) const {
+			hit_record rec;
+			return hit(r, t_min, t_max, rec);
+		}
+
 		virtual double pdf_value(const point3& o, const vec3& v) const { return 0.0; }
 		virtual vec3 random(const vec3& o) const { return vec3(1, 0, 0); }
+
+		// Does bounding_box() depend on the time interval? Only these objects have to be refit
+		// in the bvh from one frame to the next.
+		virtual bool moves() const { return false; }
+
+		// Cuts box, which holds (part of) this object, with the plane at position on axis and
+		// returns the bounds of the object on either side. Used by the spatial splits in sbvh.h.
+		// Cutting the box itself is always safe; shapes can clip their own geometry for tighter boxes.
+		virtual void split_bounds(const aabb& box, int axis, double position, aabb& left, aabb& right) const {
+			point3 left_max = box.max();
+			point3 right_min = box.min();
+			left_max[axis] = position;
+			right_min[axis] = position;
+			left = aabb(box.min(), left_max);
+			right = aabb(right_min, box.max());
+		}
 };
 
+void hit_record::resolve(const ray& r) {
+	if (object) {
+		object->surface(r, *this);
+		object = nullptr;
+	}
+}
+
 class translate : public hittable {
 	public:
 		translate(shared_ptr<hittable> p, const vec3& displacement)
@@ -37,11 +85,17 @@ class translate : public hittable {
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+		return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+	}
+
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 		virtual double pdf_value(const point3& o, const vec3& v) const override { return ptr->pdf_value(o, v); }
 
 		virtual vec3 random(const vec3& o) const override { return ptr->random(o); }
+
+		virtual bool moves() const override { return ptr->moves(); }
 	public:
 	shared_ptr<hittable> ptr;
 	vec3 offset;
@@ -52,6 +106,8 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
 	if(!ptr->hit(moved_r, t_min, t_max, rec))
 		return false;
 
+	// The point and normal have to be moved now, so this can't wait for the closest hit.
+	rec.resolve(moved_r);
 	rec.p += offset;
 	rec.set_face_normal(moved_r, rec.normal);
 
@@ -84,6 +140,9 @@ class rotate_x : public hittable {
 		rotate_x(shared_ptr<hittable> p, double angle);
 
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			return ptr->occluded(rotated(r), t_min, t_max);
+		}
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
@@ -93,6 +152,10 @@ class rotate_x : public hittable {
 
 		virtual vec3 random(const vec3& o) const override { return ptr->random(o); }
 
+	private:
+		// The ray turned into the object's unrotated space.
+		ray rotated(const ray& r) const;
+
 	public:
 		shared_ptr<hittable> ptr;
 		double sin_theta;
@@ -132,7 +195,7 @@ rotate_x::rotate_x(shared_ptr<hittable> p, double angle) : ptr(p) {
 	bbox = aabb(min, max);
 }
 
-bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_x::rotated(const ray& r) const {
 	auto origin = r.origin();
 	auto direction = r.direction();
 
@@ -142,19 +205,24 @@ bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	direction[1] = cos_theta * r.direction()[1] + sin_theta * r.direction()[2];
 	direction[2] = -sin_theta * r.direction()[1] + cos_theta * r.direction()[2];
 
-	ray rotated_r = ray(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+
+bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	ray rotated_r = rotated(r);
 
 	if(!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
+	rec.resolve(rotated_r);
 
 	auto p = rec.p;
 	auto normal = rec.normal;
 
-	p[0] = cos_theta * rec.p[0] - sin_theta * rec.p[2];
-	p[2] = sin_theta * rec.p[0] + cos_theta * rec.p[2];
+	p[1] = cos_theta * rec.p[1] - sin_theta * rec.p[2];
+	p[2] = sin_theta * rec.p[1] + cos_theta * rec.p[2];
 
-	normal[0] = cos_theta * rec.normal[0] - sin_theta * rec.normal[2];
-	normal[2] = sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+	normal[1] = cos_theta * rec.normal[1] - sin_theta * rec.normal[2];
+	normal[2] = sin_theta * rec.normal[1] + cos_theta * rec.normal[2];
 
 	rec.p = p;
 	rec.set_face_normal(rotated_r, normal);
@@ -167,6 +235,9 @@ class rotate_y : public hittable {
 		rotate_y(shared_ptr<hittable> p, double angle);
 
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			return ptr->occluded(rotated(r), t_min, t_max);
+		}
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
@@ -176,6 +247,10 @@ class rotate_y : public hittable {
 
 		virtual vec3 random(const vec3& o) const override { return ptr->random(o); }
 
+	private:
+		// The ray turned into the object's unrotated space.
+		ray rotated(const ray& r) const;
+
 	public:
 		shared_ptr<hittable> ptr;
 		double sin_theta;
@@ -215,7 +290,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 	bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_y::rotated(const ray& r) const {
 	auto origin = r.origin();
 	auto direction = r.direction();
 
@@ -225,10 +300,15 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
 	direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-	ray rotated_r = ray(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	ray rotated_r = rotated(r);
 
 	if(!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
+	rec.resolve(rotated_r);
 
 	auto p = rec.p;
 	auto normal = rec.normal;
@@ -250,6 +330,9 @@ class rotate_z : public hittable {
 		rotate_z(shared_ptr<hittable> p, double angle);
 
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			return ptr->occluded(rotated(r), t_min, t_max);
+		}
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
@@ -259,6 +342,10 @@ class rotate_z : public hittable {
 
 		virtual vec3 random(const vec3& o) const override { return ptr->random(o); }
 
+	private:
+		// The ray turned into the object's unrotated space.
+		ray rotated(const ray& r) const;
+
 	public:
 		shared_ptr<hittable> ptr;
 		double sin_theta;
@@ -298,29 +385,34 @@ rotate_z::rotate_z(shared_ptr<hittable> p, double angle) : ptr(p) {
 	bbox = aabb(min, max);
 }
 
-bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_z::rotated(const ray& r) const {
 	auto origin = r.origin();
 	auto direction = r.direction();
 
-	origin[0] = cos_theta * r.origin()[0] + sin_theta * r.origin()[2];
-	origin[2] = -sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+	origin[0] = cos_theta * r.origin()[0] + sin_theta * r.origin()[1];
+	origin[1] = -sin_theta * r.origin()[0] + cos_theta * r.origin()[1];
 
-	direction[0] = cos_theta * r.direction()[0] + sin_theta * r.direction()[2];
-	direction[2] = -sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+	direction[0] = cos_theta * r.direction()[0] + sin_theta * r.direction()[1];
+	direction[1] = -sin_theta * r.direction()[0] + cos_theta * r.direction()[1];
 
-	ray rotated_r = ray(origin, direction, r.time());
+	return ray(origin, direction, r.time());
+}
+
+bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	ray rotated_r = rotated(r);
 
 	if(!ptr->hit(rotated_r, t_min, t_max, rec))
 		return false;
+	rec.resolve(rotated_r);
 
 	auto p = rec.p;
 	auto normal = rec.normal;
 
-	p[0] = cos_theta * rec.p[0] - sin_theta * rec.p[2];
-	p[2] = sin_theta * rec.p[0] + cos_theta * rec.p[2];
+	p[0] = cos_theta * rec.p[0] - sin_theta * rec.p[1];
+	p[1] = sin_theta * rec.p[0] + cos_theta * rec.p[1];
 
-	normal[0] = cos_theta * rec.normal[0] - sin_theta * rec.normal[2];
-	normal[2] = sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+	normal[0] = cos_theta * rec.normal[0] - sin_theta * rec.normal[1];
+	normal[1] = sin_theta * rec.normal[0] + cos_theta * rec.normal[1];
 
 	rec.p = p;
 	rec.set_face_normal(rotated_r, normal);
@@ -336,10 +428,15 @@ class flip_face : public hittable {
 			if(!ptr->hit(r, t_min, t_max, rec))
 				return false;
 
+			rec.resolve(r);
 			rec.front_face = !rec.front_face;
 			return true;
 		}
 
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			return ptr->occluded(r, t_min, t_max);
+		}
+
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 			return ptr->bounding_box(time0, time1, output_box);
 		}
@@ -348,6 +445,8 @@ class flip_face : public hittable {
 
 		virtual vec3 random(const vec3& o) const override { return ptr->random(o); }
 
+		virtual bool moves() const override { return ptr->moves(); }
+
 	public:
 		shared_ptr<hittable> ptr;
 };
@@ -19,33 +19,48 @@ class hittable_list : public hittable {
 
 		virtual bool hit(
 				const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 		virtual double pdf_value(const point3& origin, const vec3& v) const override;
 		virtual vec3 random(const vec3& o) const override;
 
+		virtual bool moves() const override {
+			for (const auto& object : objects)
+				if (object->moves())
+					return true;
+			return false;
+		}
+
 	public:
 		std::vector<shared_ptr<hittable>> objects;
 };
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-	hit_record temp_rec;
+	// hit() only writes to rec when it finds a hit closer than closest_so_far, so there
+	// is no need for a temporary record.
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
 
 	for(const auto& object : objects)
 	{
-	  if(object->hit(r, t_min, closest_so_far, temp_rec))
+	  if(object->hit(r, t_min, closest_so_far, rec))
 	  {
 	    hit_anything = true;
-	    closest_so_far = temp_rec.t;
-	    rec = temp_rec;
+	    closest_so_far = rec.t;
     }
   }
 	return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+	for(const auto& object : objects)
+		if(object->occluded(r, t_min, t_max))
+			return true;
+	return false;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
 	if(objects.empty()) return false;
 
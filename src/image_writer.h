@@ -0,0 +1,616 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "common.h"
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/*
+ Writes a framebuffer to disk, or to stdout.
+
+ The framebuffer holds linear radiance, the average of the samples. The 8 bit formats get
+ it gamma corrected (gamma 2, a square root) and clamped; EXR gets it as it is, so it can
+ be graded or tonemapped later.
+
+   .ppm  binary P6
+   .png  8 bit RGB, compressed with our own small deflate (no zlib needed)
+   .exr  uncompressed scanline OpenEXR, half floats or 32 bit floats
+
+ Without a file the image goes to stdout as text P3, like it always has.
+*/
+enum class image_format { ppm_text, ppm, png, exr };
+
+inline bool image_format_from_filename(const std::string& filename, image_format& format) {
+	auto dot = filename.rfind('.');
+	if (dot == std::string::npos)
+		return false;
+	std::string ext = filename.substr(dot + 1);
+	for (char& c : ext)
+		c = tolower(c);
+	if (ext == "ppm")
+		format = image_format::ppm;
+	else if (ext == "png")
+		format = image_format::png;
+	else if (ext == "exr")
+		format = image_format::exr;
+	else
+		return false;
+	return true;
+}
+
+// With more than one frame every frame gets its own file -- name.png becomes name_0000.png and so on.
+inline std::string frame_filename(const std::string& filename, int frame, int frames) {
+	if (frames <= 1)
+		return filename;
+	char number[16];
+	snprintf(number, sizeof(number), "_%04d", frame);
+	auto dot = filename.rfind('.');
+	if (dot == std::string::npos)
+		return filename + number;
+	return filename.substr(0, dot) + number + filename.substr(dot);
+}
+
+// Turns n linear values into gamma corrected bytes. A color is three doubles in a row, so a
+// whole row of the framebuffer is one call. NaNs and negative values come out as 0.
+inline void quantize_gamma2(const double* in, uint8_t* out, size_t n) {
+	size_t i = 0;
+#if defined(__AVX__)
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d top = _mm256_set1_pd(0.999);
+	const __m256d scale = _mm256_set1_pd(256);
+	for (; i + 8 <= n; i += 8) {
+		// max_pd gives its second argument when the first is a NaN, so NaN becomes 0.
+		__m256d a = _mm256_min_pd(_mm256_max_pd(_mm256_sqrt_pd(_mm256_loadu_pd(in + i)), zero), top);
+		__m256d b = _mm256_min_pd(_mm256_max_pd(_mm256_sqrt_pd(_mm256_loadu_pd(in + i + 4)), zero), top);
+		__m128i ia = _mm256_cvttpd_epi32(_mm256_mul_pd(a, scale));
+		__m128i ib = _mm256_cvttpd_epi32(_mm256_mul_pd(b, scale));
+		__m128i words = _mm_packs_epi32(ia, ib);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(words, words));
+	}
+#endif
+	for (; i < n; ++i) {
+		double v = sqrt(in[i]);
+		if (v != v)
+			v = 0;
+		out[i] = static_cast<uint8_t>(256 * clamp(v, 0.0, 0.999));
+	}
+}
+
+namespace png_detail {
+
+inline uint32_t crc32(const uint8_t* data, size_t n, uint32_t crc = 0) {
+	static uint32_t table[256];
+	static bool made = [] {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void)made;
+	crc = ~crc;
+	for (size_t i = 0; i < n; ++i)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Deflate writes its bits from the least significant end of each byte.
+struct bit_writer {
+	std::vector<uint8_t>& out;
+	uint32_t bits = 0;
+	int count = 0;
+
+	void put(uint32_t value, int n) {
+		bits |= value << count;
+		count += n;
+		while (count >= 8) {
+			out.push_back(bits & 0xff);
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes go most significant bit first.
+	void put_code(uint32_t code, int n) {
+		uint32_t reversed = 0;
+		for (int i = 0; i < n; ++i)
+			reversed |= ((code >> i) & 1) << (n - 1 - i);
+		put(reversed, n);
+	}
+
+	void flush() {
+		if (count > 0)
+			out.push_back(bits & 0xff);
+		bits = 0;
+		count = 0;
+	}
+};
+
+inline void put_literal(bit_writer& w, int v) {
+	if (v < 144)      w.put_code(0x30 + v, 8);
+	else if (v < 256) w.put_code(0x190 + v - 144, 9);
+	else if (v < 280) w.put_code(v - 256, 7);
+	else              w.put_code(0xc0 + v - 280, 8);
+}
+
+inline void put_match(bit_writer& w, int length, int distance) {
+	static const int length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+	                                   67, 83, 99, 115, 131, 163, 195, 227, 258, 259 };
+	static const int length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const int dist_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+	                                 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32769 };
+	static const int dist_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	int l = 0;
+	while (length_base[l + 1] <= length)
+		++l;
+	put_literal(w, 257 + l);
+	w.put(length - length_base[l], length_extra[l]);
+
+	int d = 0;
+	while (dist_base[d + 1] <= distance)
+		++d;
+	w.put_code(d, 5);
+	w.put(distance - dist_base[d], dist_extra[d]);
+}
+
+// Deflate over data that arrives a few rows at a time. It is one block with the fixed
+// Huffman codes, and matches are found with hash chains over the last 32K, like
+// stb_image_write does. The codes are not tuned to the image, but filtered rows of a
+// render are mostly small numbers and repeats, so it still gets most of the way to zlib.
+//
+// Only the window is kept, so memory doesn't grow with the image.
+class deflate_stream {
+	public:
+		deflate_stream() : head(1 << hash_bits, -1), prev(window, -1), w{ out } {
+			out = { 0x78, 0x01 }; // zlib header: deflate, 32K window, no dictionary
+			w.put(1, 1); // last block
+			w.put(1, 2); // fixed Huffman codes
+		}
+
+		void add(const uint8_t* data, size_t n) {
+			for (size_t i = 0; i < n; ++i) {
+				adler_a = (adler_a + data[i]) % 65521;
+				adler_b = (adler_b + adler_a) % 65521;
+			}
+			buffer.insert(buffer.end(), data, data + n);
+			// The last couple of bytes wait for the next rows, they can't start a match yet.
+			compress(false);
+		}
+
+		// Everything compressed since the last call.
+		std::vector<uint8_t> take() {
+			std::vector<uint8_t> done;
+			done.swap(out);
+			return done;
+		}
+
+		std::vector<uint8_t> finish() {
+			compress(true);
+			put_literal(w, 256); // end of block
+			w.flush();
+			uint32_t adler = (adler_b << 16) | adler_a;
+			for (int shift = 24; shift >= 0; shift -= 8)
+				out.push_back((adler >> shift) & 0xff);
+			return take();
+		}
+
+	private:
+		static const int window = 32768;
+		static const int hash_bits = 15;
+		static const int max_chain = 32;
+		static const int min_match = 3, max_match = 258;
+
+		// Positions count from the start of the stream; buffer[0] is position base.
+		uint8_t at(int64_t position) const { return buffer[position - base]; }
+
+		uint32_t hash(int64_t i) const {
+			return ((at(i) << 16 | at(i + 1) << 8 | at(i + 2)) * 2654435761u) >> (32 - hash_bits);
+		}
+
+		void insert(int64_t i) {
+			if (i + min_match > end())
+				return;
+			uint32_t h = hash(i);
+			prev[i % window] = head[h];
+			head[h] = i;
+		}
+
+		int64_t end() const { return base + static_cast<int64_t>(buffer.size()); }
+
+		void compress(bool final) {
+			const int64_t stop = final ? end() : end() - (min_match - 1);
+			while (next < stop) {
+				int best_length = 0, best_distance = 0;
+				if (next + min_match <= end()) {
+					int64_t candidate = head[hash(next)];
+					int limit = static_cast<int>(std::min<int64_t>(max_match, end() - next));
+					for (int chain = 0; candidate >= 0 && chain < max_chain; ++chain) {
+						int64_t distance = next - candidate;
+						if (distance > window)
+							break;
+						int length = 0;
+						while (length < limit && at(candidate + length) == at(next + length))
+							++length;
+						if (length > best_length) {
+							best_length = length;
+							best_distance = static_cast<int>(distance);
+							if (length == limit)
+								break;
+						}
+						int64_t older = prev[candidate % window];
+						if (older >= candidate)
+							break;
+						candidate = older;
+					}
+				}
+
+				if (best_length >= min_match) {
+					put_match(w, best_length, best_distance);
+					for (int k = 0; k < best_length; ++k)
+						insert(next + k);
+					next += best_length;
+				} else {
+					put_literal(w, at(next));
+					insert(next);
+					++next;
+				}
+			}
+
+			// Drop what has fallen out of the window.
+			int64_t keep_from = std::max<int64_t>(base, next - window);
+			if (keep_from - base > window) {
+				buffer.erase(buffer.begin(), buffer.begin() + (keep_from - base));
+				base = keep_from;
+			}
+		}
+
+		std::vector<uint8_t> buffer;
+		int64_t base = 0;
+		int64_t next = 0;
+		std::vector<int64_t> head, prev;
+		std::vector<uint8_t> out;
+		bit_writer w;
+		uint32_t adler_a = 1, adler_b = 0;
+};
+
+inline int paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+inline void put_chunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data) {
+	uint32_t n = data.size();
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back((n >> shift) & 0xff);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	uint32_t crc = crc32(&out[start], out.size() - start);
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back((crc >> shift) & 0xff);
+}
+
+} // namespace png_detail
+
+// Round to nearest even, with overflow to infinity and underflow through the denormals.
+inline uint16_t float_to_half(float f) {
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint16_t sign = (x >> 16) & 0x8000;
+	uint32_t exponent = (x >> 23) & 0xff;
+	uint32_t mantissa = x & 0x7fffff;
+
+	if (exponent == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	int e = static_cast<int>(exponent) - 127 + 15;
+	if (e >= 31)
+		return sign | 0x7c00;
+	if (e <= 0) {
+		if (e < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - e;
+		uint32_t h = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (h & 1)))
+			++h;
+		return sign | h;
+	}
+	uint32_t h = (e << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	// A carry out of the mantissa bumps the exponent, which is the right answer.
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+		++h;
+	return sign | h;
+}
+
+/*
+ The formats are all written from the top row down, a band of rows at a time, so the
+ writer thread (see tile_writer.h) can send each band off as soon as its tiles are
+ rendered instead of waiting for the whole image.
+*/
+class image_encoder {
+	public:
+		image_encoder(std::ostream& out) : out(out) {}
+		virtual ~image_encoder() {}
+
+		virtual void begin(int width, int height) = 0;
+		// Rows [first, last) of fb, counted from the top. Every row comes exactly once, in order.
+		virtual void rows(const framebuffer& fb, int first, int last) = 0;
+		virtual void end() {}
+
+		void flush() { out.flush(); }
+
+	protected:
+		void write(const std::vector<uint8_t>& bytes) {
+			out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		}
+
+		// The 8 bit rows, 3 bytes a pixel.
+		static std::vector<uint8_t> quantize_rows(const framebuffer& fb, int first, int last) {
+			const size_t stride = size_t(fb.width) * 3;
+			std::vector<uint8_t> bytes(stride * (last - first));
+			std::vector<color> pixels(fb.width);
+			for (int row = first; row < last; ++row) {
+				fb.load_row(row, pixels.data());
+				quantize_gamma2(&pixels[0].e[0], &bytes[(row - first) * stride], stride);
+			}
+			return bytes;
+		}
+
+		std::ostream& out;
+};
+
+// Text P3, each band built in memory and written in one go instead of three operator<< per pixel.
+class ppm_text_encoder : public image_encoder {
+	public:
+		using image_encoder::image_encoder;
+
+		virtual void begin(int width, int height) override {
+			out << "P3\n" << width << " " << height << "\n255\n";
+		}
+
+		virtual void rows(const framebuffer& fb, int first, int last) override {
+			// The text of every byte value, with the space after it.
+			static const std::vector<std::string> numbers = [] {
+				std::vector<std::string> text(256);
+				for (int v = 0; v < 256; ++v)
+					text[v] = std::to_string(v) + " ";
+				return text;
+			}();
+
+			std::vector<uint8_t> bytes = quantize_rows(fb, first, last);
+			std::string text;
+			text.reserve(bytes.size() * 4);
+			for (size_t i = 0; i < bytes.size(); ++i) {
+				text += numbers[bytes[i]];
+				if (i % 3 == 2)
+					text.back() = '\n';
+			}
+			out.write(text.data(), text.size());
+		}
+};
+
+class ppm_encoder : public image_encoder {
+	public:
+		using image_encoder::image_encoder;
+
+		virtual void begin(int width, int height) override {
+			out << "P6\n" << width << " " << height << "\n255\n";
+		}
+
+		virtual void rows(const framebuffer& fb, int first, int last) override {
+			write(quantize_rows(fb, first, last));
+		}
+};
+
+// Each band becomes one IDAT chunk of the same zlib stream.
+class png_encoder : public image_encoder {
+	public:
+		using image_encoder::image_encoder;
+
+		virtual void begin(int width, int height) override {
+			using namespace png_detail;
+			std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+			std::vector<uint8_t> header;
+			for (uint32_t v : { uint32_t(width), uint32_t(height) })
+				for (int shift = 24; shift >= 0; shift -= 8)
+					header.push_back((v >> shift) & 0xff);
+			header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bits, RGB, deflate, no interlace
+			put_chunk(png, "IHDR", header);
+			write(png);
+			up.assign(size_t(width) * 3, 0);
+		}
+
+		virtual void rows(const framebuffer& fb, int first, int last) override {
+			using namespace png_detail;
+			std::vector<uint8_t> bytes = quantize_rows(fb, first, last);
+			const size_t stride = size_t(fb.width) * 3;
+
+			// Every row gets whichever of the five filters leaves the smallest numbers, the usual
+			// guess at what will compress best.
+			std::vector<uint8_t> filtered;
+			filtered.reserve((stride + 1) * (last - first));
+			std::vector<uint8_t> candidate(stride), best(stride);
+			for (int row = first; row < last; ++row) {
+				const uint8_t* cur = &bytes[(row - first) * stride];
+				long best_sum = -1;
+				int best_filter = 0;
+				for (int filter = 0; filter < 5; ++filter) {
+					long sum = 0;
+					for (size_t i = 0; i < stride; ++i) {
+						int a = i >= 3 ? cur[i - 3] : 0;
+						int b = up[i];
+						int c = i >= 3 ? up[i - 3] : 0;
+						int predicted = 0;
+						switch (filter) {
+							case 1: predicted = a; break;
+							case 2: predicted = b; break;
+							case 3: predicted = (a + b) / 2; break;
+							case 4: predicted = paeth(a, b, c); break;
+						}
+						candidate[i] = static_cast<uint8_t>(cur[i] - predicted);
+						sum += abs(static_cast<int8_t>(candidate[i]));
+					}
+					if (best_sum < 0 || sum < best_sum) {
+						best_sum = sum;
+						best_filter = filter;
+						best.swap(candidate);
+					}
+				}
+				filtered.push_back(best_filter);
+				filtered.insert(filtered.end(), best.begin(), best.end());
+				up.assign(cur, cur + stride);
+			}
+
+			zlib.add(filtered.data(), filtered.size());
+			std::vector<uint8_t> compressed = zlib.take();
+			if (!compressed.empty()) {
+				std::vector<uint8_t> chunk;
+				put_chunk(chunk, "IDAT", compressed);
+				write(chunk);
+			}
+		}
+
+		virtual void end() override {
+			using namespace png_detail;
+			std::vector<uint8_t> chunks;
+			put_chunk(chunks, "IDAT", zlib.finish());
+			put_chunk(chunks, "IEND", {});
+			write(chunks);
+		}
+
+	private:
+		png_detail::deflate_stream zlib;
+		// The row above, unfiltered. Zero above the first row.
+		std::vector<uint8_t> up;
+};
+
+// Scanline OpenEXR with no compression and one line per block. Every block is the same
+// size, so the offset table can be written up front. Channels have to be in alphabetical
+// order, so B, G, R.
+class exr_encoder : public image_encoder {
+	public:
+		exr_encoder(std::ostream& out, bool full_float) : image_encoder(out), full_float(full_float) {}
+
+		virtual void begin(int width, int height) override {
+			std::vector<uint8_t> exr;
+			auto put32 = [&exr](uint32_t v) { for (int i = 0; i < 4; ++i) exr.push_back((v >> (8 * i)) & 0xff); };
+			auto put64 = [&exr](uint64_t v) { for (int i = 0; i < 8; ++i) exr.push_back((v >> (8 * i)) & 0xff); };
+			auto putf = [&put32](float f) { uint32_t v; memcpy(&v, &f, 4); put32(v); };
+			auto puts = [&exr](const char* s) { exr.insert(exr.end(), s, s + strlen(s) + 1); };
+			auto attribute = [&](const char* name, const char* type, uint32_t size) { puts(name); puts(type); put32(size); };
+
+			put32(20000630); // magic
+			put32(2);        // version 2, scanlines
+
+			attribute("channels", "chlist", 3 * 18 + 1);
+			for (const char* channel : { "B", "G", "R" }) {
+				puts(channel);
+				put32(full_float ? 2 : 1); // pixel type
+				put32(0); // pLinear and reserved
+				put32(1); // x sampling
+				put32(1); // y sampling
+			}
+			exr.push_back(0);
+			attribute("compression", "compression", 1);
+			exr.push_back(0);
+			for (const char* window : { "dataWindow", "displayWindow" }) {
+				attribute(window, "box2i", 16);
+				put32(0); put32(0); put32(width - 1); put32(height - 1);
+			}
+			attribute("lineOrder", "lineOrder", 1);
+			exr.push_back(0);
+			attribute("pixelAspectRatio", "float", 4);
+			putf(1);
+			attribute("screenWindowCenter", "v2f", 8);
+			putf(0); putf(0);
+			attribute("screenWindowWidth", "float", 4);
+			putf(1);
+			exr.push_back(0); // end of header
+
+			const uint64_t line_bytes = 3 * uint64_t(width) * (full_float ? 4 : 2);
+			uint64_t offset = exr.size() + 8 * uint64_t(height);
+			for (int row = 0; row < height; ++row) {
+				put64(offset);
+				offset += 8 + line_bytes;
+			}
+			write(exr);
+		}
+
+		virtual void rows(const framebuffer& fb, int first, int last) override {
+			const uint32_t line_bytes = 3 * fb.width * (full_float ? 4 : 2);
+			std::vector<uint8_t> exr;
+			exr.reserve((8 + line_bytes) * size_t(last - first));
+			auto put32 = [&exr](uint32_t v) { for (int i = 0; i < 4; ++i) exr.push_back((v >> (8 * i)) & 0xff); };
+			std::vector<color> pixels(fb.width);
+			for (int row = first; row < last; ++row) {
+				put32(row);
+				put32(line_bytes);
+				fb.load_row(row, pixels.data());
+				for (int channel = 2; channel >= 0; --channel) {
+					for (int x = 0; x < fb.width; ++x) {
+						float v = static_cast<float>(pixels[x][channel]);
+						if (full_float) {
+							uint32_t bits;
+							memcpy(&bits, &v, 4);
+							put32(bits);
+						} else {
+							uint16_t h = float_to_half(v);
+							exr.push_back(h & 0xff);
+							exr.push_back(h >> 8);
+						}
+					}
+				}
+			}
+			write(exr);
+		}
+
+	private:
+		bool full_float;
+};
+
+inline std::unique_ptr<image_encoder> make_image_encoder(std::ostream& out, image_format format, bool exr_float) {
+	switch (format) {
+		case image_format::ppm: return std::unique_ptr<image_encoder>(new ppm_encoder(out));
+		case image_format::png: return std::unique_ptr<image_encoder>(new png_encoder(out));
+		case image_format::exr: return std::unique_ptr<image_encoder>(new exr_encoder(out, exr_float));
+		default: return std::unique_ptr<image_encoder>(new ppm_text_encoder(out));
+	}
+}
+
+// The whole image at once.
+inline void write_image(std::ostream& out, const framebuffer& fb, image_format format, bool exr_float) {
+	auto encoder = make_image_encoder(out, format, exr_float);
+	encoder->begin(fb.width, fb.height);
+	encoder->rows(fb, 0, fb.height);
+	encoder->end();
+}
+
+inline bool write_image(const std::string& filename, const framebuffer& fb, image_format format, bool exr_float) {
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+		return false;
+	write_image(out, fb, format, exr_float);
+	return static_cast<bool>(out);
+}
+
+#endif
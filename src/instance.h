@@ -0,0 +1,288 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "common.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+/*
+ An affine transform stored as the top 3 rows of a 4x4 matrix.
+ The bottom row is always 0 0 0 1 so it is left out.
+*/
+class affine {
+	public:
+		affine() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+		static affine translation(const vec3& offset) {
+			affine t;
+			t.m[0][3] = offset.x();
+			t.m[1][3] = offset.y();
+			t.m[2][3] = offset.z();
+			return t;
+		}
+
+		// Rotations in the same direction as rotate_x, rotate_y and rotate_z.
+		static affine rotation_x(double sin_theta, double cos_theta) {
+			affine t;
+			t.m[1][1] = cos_theta; t.m[1][2] = -sin_theta;
+			t.m[2][1] = sin_theta; t.m[2][2] = cos_theta;
+			return t;
+		}
+
+		static affine rotation_y(double sin_theta, double cos_theta) {
+			affine t;
+			t.m[0][0] = cos_theta;  t.m[0][2] = sin_theta;
+			t.m[2][0] = -sin_theta; t.m[2][2] = cos_theta;
+			return t;
+		}
+
+		static affine rotation_z(double sin_theta, double cos_theta) {
+			affine t;
+			t.m[0][0] = cos_theta; t.m[0][1] = -sin_theta;
+			t.m[1][0] = sin_theta; t.m[1][1] = cos_theta;
+			return t;
+		}
+
+		// Rotations by angle degrees.
+		static affine rotation_x(double angle) {
+			return rotation_x(sin(degrees_to_radians(angle)), cos(degrees_to_radians(angle)));
+		}
+
+		static affine rotation_y(double angle) {
+			return rotation_y(sin(degrees_to_radians(angle)), cos(degrees_to_radians(angle)));
+		}
+
+		static affine rotation_z(double angle) {
+			return rotation_z(sin(degrees_to_radians(angle)), cos(degrees_to_radians(angle)));
+		}
+
+		static affine scale(const vec3& s) {
+			affine t;
+			t.m[0][0] = s.x();
+			t.m[1][1] = s.y();
+			t.m[2][2] = s.z();
+			return t;
+		}
+
+		point3 point(const point3& p) const {
+			return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			              m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			              m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+		}
+
+		vec3 vector(const vec3& v) const {
+			return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			            m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			            m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+		}
+
+		// Normals transform by the inverse transpose, so this has to be called on the
+		// inverse of the transform that moved the points.
+		vec3 normal_from_inverse(const vec3& n) const {
+			return vec3(m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+			            m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+			            m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z());
+		}
+
+		affine inverse() const;
+
+	public:
+		double m[3][4];
+};
+
+// a * b applies b first, then a.
+inline affine operator*(const affine& a, const affine& b) {
+	affine r;
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+		}
+		r.m[i][3] += a.m[i][3];
+	}
+	return r;
+}
+
+affine affine::inverse() const {
+	// Invert the 3x3 part with cofactors, then the translation is -inverse * t.
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+	           - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+	           + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	double inv_det = 1.0 / det;
+
+	affine r;
+	r.m[0][0] =  (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+	r.m[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]) * inv_det;
+	r.m[0][2] =  (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+	r.m[1][0] = -(m[1][0] * m[2][2] - m[1][2] * m[2][0]) * inv_det;
+	r.m[1][1] =  (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+	r.m[1][2] = -(m[0][0] * m[1][2] - m[0][2] * m[1][0]) * inv_det;
+	r.m[2][0] =  (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+	r.m[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]) * inv_det;
+	r.m[2][2] =  (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+	vec3 t = r.vector(vec3(m[0][3], m[1][3], m[2][3]));
+	r.m[0][3] = -t.x();
+	r.m[1][3] = -t.y();
+	r.m[2][3] = -t.z();
+	return r;
+}
+
+/*
+ One placement of a shared piece of geometry.
+
+ translate and rotate_* each wrap one object and transform the ray by themselves,
+ so a chain of them is a virtual call and a transform per link. An instance holds the
+ whole chain as one matrix (and its inverse), so the ray is transformed once. The
+ object is only referenced, so any number of instances can share one bottom level
+ bvh -- 10,000 trees in a forest only store the tree's triangles once.
+
+ The world bvh is built over the instances like any other object, which makes it
+ the top level of a two level hierarchy.
+*/
+class instance : public hittable {
+	public:
+		instance(shared_ptr<hittable> p, const affine& transform)
+			: ptr(p), to_world(transform), to_object(transform.inverse()) {
+			aabb object_box;
+			hasbox = ptr->bounding_box(0, 1, object_box);
+			bbox = world_box(object_box);
+		}
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			COUNT_STAT(primitive_tests[stat_instance], 1);
+			return ptr->occluded(ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time()), t_min, t_max);
+		}
+		// The box of an object that doesn't move is worked out once. One that does move
+		// (a moving_sphere, say) has its box turned into world space for every interval.
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+			if (!ptr->moves()) {
+				output_box = bbox;
+				return hasbox;
+			}
+			aabb object_box;
+			if (!ptr->bounding_box(time0, time1, object_box))
+				return false;
+			output_box = world_box(object_box);
+			return true;
+		}
+
+		virtual bool moves() const override { return ptr->moves(); }
+
+		// NOTE :: these are only right for rigid transforms. A scale changes the solid angle
+		//         the object covers, and the pdf would have to account for that.
+		virtual double pdf_value(const point3& o, const vec3& v) const override {
+			return ptr->pdf_value(to_object.point(o), to_object.vector(v));
+		}
+
+		virtual vec3 random(const vec3& o) const override {
+			return to_world.vector(ptr->random(to_object.point(o)));
+		}
+
+	private:
+		aabb world_box(const aabb& object_box) const;
+
+	public:
+		shared_ptr<hittable> ptr;
+		affine to_world;
+		affine to_object;
+		bool hasbox;
+		aabb bbox;
+};
+
+// The box around the eight corners of object_box, moved into world space.
+aabb instance::world_box(const aabb& object_box) const {
+	point3 min(infinity, infinity, infinity);
+	point3 max(-infinity, -infinity, -infinity);
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			for (int k = 0; k < 2; k++) {
+				point3 corner(i ? object_box.max().x() : object_box.min().x(),
+				              j ? object_box.max().y() : object_box.min().y(),
+				              k ? object_box.max().z() : object_box.min().z());
+				point3 tester = to_world.point(corner);
+				for (int c = 0; c < 3; c++) {
+					min[c] = fmin(min[c], tester[c]);
+					max[c] = fmax(max[c], tester[c]);
+				}
+			}
+		}
+	}
+	return aabb(min, max);
+}
+
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	COUNT_STAT(primitive_tests[stat_instance], 1);
+	// The direction is not normalized after the transform, so t means the same thing in both spaces.
+	ray object_r(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+	if (!ptr->hit(object_r, t_min, t_max, rec))
+		return false;
+
+	// The hit has to be turned into world space here, so it can't wait for the closest one.
+	// It is still only resolved once per instance hit, not once per primitive inside it.
+	rec.resolve(object_r);
+
+	// rec.normal was already flipped to face the ray in object space. The inverse transpose
+	// keeps the sign of dot(normal, direction), so front_face is still right.
+	rec.p = to_world.point(rec.p);
+	rec.normal = unit_vector(to_object.normal_from_inverse(rec.normal));
+	return true;
+}
+
+// Turns a chain of translate/rotate_* wrappers into one instance of the innermost object,
+// and does the same for every chain inside a hittable_list or bvh_node on the way down.
+// Anything else is returned as it is.
+//
+// NOTE :: the wrappers call set_face_normal again on a normal that already faces the ray,
+//         so after one of them front_face is no longer the object's. The instance keeps it.
+inline shared_ptr<hittable> flatten_transforms(shared_ptr<hittable> object) {
+	affine transform;
+	bool transformed = false;
+	while (true) {
+		if (auto t = std::dynamic_pointer_cast<translate>(object)) {
+			transform = transform * affine::translation(t->offset);
+			object = t->ptr;
+		} else if (auto rx = std::dynamic_pointer_cast<rotate_x>(object)) {
+			transform = transform * affine::rotation_x(rx->sin_theta, rx->cos_theta);
+			object = rx->ptr;
+		} else if (auto ry = std::dynamic_pointer_cast<rotate_y>(object)) {
+			transform = transform * affine::rotation_y(ry->sin_theta, ry->cos_theta);
+			object = ry->ptr;
+		} else if (auto rz = std::dynamic_pointer_cast<rotate_z>(object)) {
+			transform = transform * affine::rotation_z(rz->sin_theta, rz->cos_theta);
+			object = rz->ptr;
+		} else {
+			break;
+		}
+		transformed = true;
+	}
+
+	// Copies rather than changing them in place, the same list or node may be used elsewhere.
+	// A node keeps its box: an instance's box is never bigger than the one of the chain it replaces.
+	if (auto list = std::dynamic_pointer_cast<hittable_list>(object)) {
+		auto flattened = make_shared<hittable_list>();
+		for (const auto& child : list->objects)
+			flattened->add(flatten_transforms(child));
+		object = flattened;
+	} else if (auto node = std::dynamic_pointer_cast<bvh_node>(object)) {
+		auto flattened = make_shared<bvh_node>(*node);
+		flattened->left = flatten_transforms(node->left);
+		if (node->right)
+			flattened->right = flatten_transforms(node->right);
+		object = flattened;
+	}
+
+	if (!transformed)
+		return object;
+	return make_shared<instance>(object, transform);
+}
+
+inline hittable_list flatten_transforms(const hittable_list& list) {
+	hittable_list flattened;
+	for (const auto& object : list.objects)
+		flattened.add(flatten_transforms(object));
+	return flattened;
+}
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "common.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+ Linear BVH (LBVH) construction from Morton codes.
+
+ Every object's centroid is quantized onto a grid over the scene and the bits of
+ the x, y and z cells are interleaved into one Morton code. Sorting by that code puts
+ objects that are close in space next to each other, and the tree falls out of the
+ sorted codes: each internal node covers a range of codes that share a common prefix
+ and splits where the next bit changes.
+
+ The internal nodes are found with the method from Karras, "Maximizing Parallelism in
+ the Construction of BVHs, Octrees, and k-d Trees" (2012). Every internal node can be
+ worked out on its own from the sorted codes, so there is nothing sequential in
+ the whole build except a final pass that lays the nodes out for linear_bvh.
+
+ The trees are worse than SAH trees, but the build is a few linear passes over the
+ objects, so it is meant for scenes that are big and only rendered once.
+*/
+
+// 30 bit codes are 10 bits per axis, 63 bit codes are 21 bits per axis.
+inline uint64_t expand_bits_10(uint64_t v) {
+	// Put two zero bits between each of the low 10 bits of v.
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x30000ff;
+	v = (v | (v << 8)) & 0x300f00f;
+	v = (v | (v << 4)) & 0x30c30c3;
+	v = (v | (v << 2)) & 0x9249249;
+	return v;
+}
+
+inline uint64_t expand_bits_21(uint64_t v) {
+	// Put two zero bits between each of the low 21 bits of v.
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffULL;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+	v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
+}
+
+inline uint64_t morton_code(const point3& p, int bits) {
+	// p is in [0, 1] on every axis.
+	const int per_axis = bits / 3;
+	const double cells = static_cast<double>(1ULL << per_axis);
+	uint64_t c[3];
+	for (int a = 0; a < 3; ++a) {
+		double x = clamp(p[a] * cells, 0.0, cells - 1.0);
+		c[a] = static_cast<uint64_t>(x);
+	}
+
+	if (per_axis == 10)
+		return (expand_bits_10(c[0]) << 2) | (expand_bits_10(c[1]) << 1) | expand_bits_10(c[2]);
+	return (expand_bits_21(c[0]) << 2) | (expand_bits_21(c[1]) << 1) | expand_bits_21(c[2]);
+}
+
+struct morton_primitive {
+	uint64_t code;
+	uint32_t index;
+};
+
+// Run f(start, end) over [0, n) split into one chunk per thread.
+template <typename F>
+void parallel_chunks(size_t n, int num_threads, F f) {
+	if (num_threads <= 1 || n < bvh_parallel_threshold) {
+		f(0, n);
+		return;
+	}
+
+	task_group group;
+	size_t chunk = (n + num_threads - 1) / num_threads;
+	for (size_t start = chunk; start < n; start += chunk) {
+		size_t end = std::min(start + chunk, n);
+		group.run([&f, start, end]() { f(start, end); });
+	}
+	f(0, std::min(chunk, n));
+	group.wait();
+}
+
+// Least significant digit radix sort on the Morton codes, 8 bits per pass.
+// Each thread counts the digits in its own chunk, the counts are turned into
+// starting offsets per (digit, chunk), and each thread scatters its chunk.
+// That keeps the sort stable without any locking.
+inline void radix_sort(std::vector<morton_primitive>& v, int bits, int num_threads) {
+	const int bits_per_pass = 8;
+	const int buckets = 1 << bits_per_pass;
+	const int passes = (bits + bits_per_pass - 1) / bits_per_pass;
+
+	if (num_threads < 1 || v.size() < bvh_parallel_threshold)
+		num_threads = 1;
+	const size_t n = v.size();
+	const size_t chunk = (n + num_threads - 1) / num_threads;
+
+	std::vector<morton_primitive> temp(n);
+	std::vector<size_t> counts(num_threads * buckets);
+
+	for (int pass = 0; pass < passes; ++pass) {
+		const int shift = pass * bits_per_pass;
+		std::fill(counts.begin(), counts.end(), 0);
+
+		parallel_chunks(n, num_threads, [&](size_t start, size_t end) {
+			size_t* count = &counts[(start / chunk) * buckets];
+			for (size_t i = start; i < end; ++i)
+				count[(v[i].code >> shift) & (buckets - 1)]++;
+		});
+
+		// Digit major, chunk minor, so equal digits from earlier chunks come first.
+		size_t offset = 0;
+		for (int b = 0; b < buckets; ++b) {
+			for (int t = 0; t < num_threads; ++t) {
+				size_t c = counts[t * buckets + b];
+				counts[t * buckets + b] = offset;
+				offset += c;
+			}
+		}
+
+		parallel_chunks(n, num_threads, [&](size_t start, size_t end) {
+			size_t* next = &counts[(start / chunk) * buckets];
+			for (size_t i = start; i < end; ++i)
+				temp[next[(v[i].code >> shift) & (buckets - 1)]++] = v[i];
+		});
+
+		std::swap(v, temp);
+	}
+}
+
+// The internal nodes of the tree. Children with the high bit set are leaves,
+// and leaf k is the object order[k] after build_lbvh has sorted order.
+const uint32_t lbvh_leaf = 0x80000000u;
+
+struct lbvh_tree {
+	std::vector<uint32_t> left;
+	std::vector<uint32_t> right;
+};
+
+// Length of the common prefix of the codes at i and j. Equal codes fall back to
+// comparing the indices, so every key is unique (Karras section 4).
+inline int common_prefix(const std::vector<morton_primitive>& sorted, int64_t i, int64_t j) {
+	if (j < 0 || j >= static_cast<int64_t>(sorted.size()))
+		return -1;
+	uint64_t a = sorted[i].code;
+	uint64_t b = sorted[j].code;
+	if (a == b)
+		return 64 + __builtin_clzll(static_cast<uint64_t>(i ^ j));
+	return __builtin_clzll(a ^ b);
+}
+
+// Sorts order by Morton code and returns the hierarchy over it.
+inline lbvh_tree build_lbvh(const std::vector<bvh_primitive>& prims, std::vector<uint32_t>& order, int bits, int num_threads) {
+	const size_t n = order.size();
+	lbvh_tree tree;
+	if (n < 2)
+		return tree;
+
+	aabb centroid_bounds = aabb::empty();
+	for (uint32_t i : order)
+		centroid_bounds = surrounding_box(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+	vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+	for (int a = 0; a < 3; ++a)
+		if (extent[a] <= 0)
+			extent[a] = 1;
+
+	std::vector<morton_primitive> sorted(n);
+	parallel_chunks(n, num_threads, [&](size_t start, size_t end) {
+		for (size_t i = start; i < end; ++i) {
+			point3 p = prims[order[i]].centroid - centroid_bounds.min();
+			sorted[i].code = morton_code(point3(p.x() / extent.x(), p.y() / extent.y(), p.z() / extent.z()), bits);
+			sorted[i].index = order[i];
+		}
+	});
+	radix_sort(sorted, bits, num_threads);
+	for (size_t i = 0; i < n; ++i)
+		order[i] = sorted[i].index;
+
+	tree.left.resize(n - 1);
+	tree.right.resize(n - 1);
+	parallel_chunks(n - 1, num_threads, [&](size_t start, size_t end) {
+		for (int64_t i = start; i < static_cast<int64_t>(end); ++i) {
+			// Which way the range of this node goes from i.
+			int d = (common_prefix(sorted, i, i + 1) - common_prefix(sorted, i, i - 1)) >= 0 ? 1 : -1;
+
+			// Find the other end of the range with an exponential then binary search.
+			int delta_min = common_prefix(sorted, i, i - d);
+			int64_t l_max = 2;
+			while (common_prefix(sorted, i, i + l_max * d) > delta_min)
+				l_max *= 2;
+			int64_t l = 0;
+			for (int64_t t = l_max / 2; t >= 1; t /= 2)
+				if (common_prefix(sorted, i, i + (l + t) * d) > delta_min)
+					l += t;
+			int64_t j = i + l * d;
+
+			// Find where the shared prefix of the range ends.
+			int delta_node = common_prefix(sorted, i, j);
+			int64_t s = 0;
+			int64_t t = l;
+			do {
+				t = (t + 1) / 2;
+				if (common_prefix(sorted, i, i + (s + t) * d) > delta_node)
+					s += t;
+			} while (t > 1);
+			int64_t split = i + s * d + std::min(d, 0);
+
+			tree.left[i] = (std::min(i, j) == split) ? (split | lbvh_leaf) : split;
+			tree.right[i] = (std::max(i, j) == split + 1) ? ((split + 1) | lbvh_leaf) : split + 1;
+		}
+	});
+
+	return tree;
+}
+
+#endif
@@ -0,0 +1,501 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "common.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "lbvh.h"
+#include "sbvh.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+ A bounding volume hierarchy flattened into one array.
+
+ bvh_node is a tree of shared_ptrs, so every node is its own heap allocation and
+ every step down the tree is a virtual hit() call. Here the nodes are stored
+ depth first in a single vector:
+   - the left child of an interior node is always the very next node
+   - the right child is at second_child
+   - a leaf's objects are primitives[first_primitive, first_primitive + count)
+ Traversal is a loop with a small stack of node indices instead of recursion.
+*/
+struct linear_bvh_node {
+	float box_min[3];
+	float box_max[3];
+	union {
+		uint32_t first_primitive; // Leaf
+		uint32_t second_child;    // Interior
+	};
+	uint16_t count;               // Number of primitives, 0 for interior nodes
+	uint8_t axis;                 // Split axis of interior nodes
+	uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+// Rounding a double to float can shrink the box, so round min down and max up.
+inline float round_down(double d) {
+	float f = static_cast<float>(d);
+	return (f > d) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double d) {
+	float f = static_cast<float>(d);
+	return (f < d) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+inline void set_node_box(linear_bvh_node& node, const aabb& box) {
+	for (int a = 0; a < 3; ++a) {
+		node.box_min[a] = round_down(box.min()[a]);
+		node.box_max[a] = round_up(box.max()[a]);
+	}
+}
+
+inline aabb node_box(const linear_bvh_node& node) {
+	return aabb(point3(node.box_min[0], node.box_min[1], node.box_min[2]),
+	            point3(node.box_max[0], node.box_max[1], node.box_max[2]));
+}
+
+inline bool same_box(const aabb& a, const aabb& b) {
+	for (int i = 0; i < 3; ++i)
+		if (a.min()[i] != b.min()[i] || a.max()[i] != b.max()[i])
+			return false;
+	return true;
+}
+
+// The box around primitives[first, first + count) over [time0, time1].
+inline aabb primitives_box(const std::vector<shared_ptr<hittable>>& primitives, uint32_t first, uint32_t count,
+                           double time0, double time1) {
+	aabb box = aabb::empty();
+	for (uint32_t i = first; i < first + count; ++i) {
+		aabb object_box;
+		primitives[i]->bounding_box(time0, time1, object_box);
+		box = surrounding_box(box, object_box);
+	}
+	return box;
+}
+
+// The last few objects a ray was tested against. A spatial split can put an object in several
+// leaves, and testing it again can't find a closer hit, so a ray skips objects it has seen.
+// It's direct mapped on the object's index, so a collision only costs a repeated test.
+struct mailbox {
+	static const int size = 8;
+	uint32_t objects[size];
+
+	mailbox() { std::fill(objects, objects + size, UINT32_MAX); }
+
+	// Returns true if object was already tested, and remembers it otherwise.
+	bool seen(uint32_t object) {
+		uint32_t& slot = objects[object & (size - 1)];
+		if (slot == object)
+			return true;
+		slot = object;
+		return false;
+	}
+};
+
+// The node's share of the SAH cost of the tree, before dividing by the area of the root.
+inline double node_cost(const linear_bvh_node& node) {
+	return node_box(node).surface_area() * (node.count > 0 ? node.count : sah_traversal_cost);
+}
+
+class linear_bvh : public refittable_bvh {
+	public:
+		linear_bvh() {}
+		linear_bvh(const hittable_list& list, double time0, double time1, bvh_method method = bvh_method::sah, int num_threads = 1);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+		virtual void refit(double time0, double time1, int num_threads = 1) override;
+		virtual void refit_objects(double time0, double time1, const std::vector<uint32_t>& moved) override;
+		virtual double degradation() const override {
+			return nodes.empty() ? 1.0 : (cost_sum / node_box(nodes[0]).surface_area()) / built_cost;
+		}
+
+	private:
+		void build(const std::vector<bvh_primitive>& prims, std::vector<uint32_t>& order, size_t start, size_t end,
+		           bvh_method method, int num_threads, int depth, std::vector<linear_bvh_node>& out) const;
+		aabb flatten_lbvh(const lbvh_tree& tree, const std::vector<bvh_primitive>& prims,
+		                  const std::vector<uint32_t>& order, uint32_t ref);
+		aabb refit_node(uint32_t index, double time0, double time1, int num_threads, double& cost);
+
+	public:
+		std::vector<linear_bvh_node> nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+
+		// Where each object of the original list ended up in primitives. With spatial splits an
+		// object can be in several places, and this is only one of them.
+		std::vector<uint32_t> object_slot;
+
+		// The object of the original list behind each primitive. Only kept when spatial splits
+		// put some objects in more than one leaf, so hit() knows to use a mailbox.
+		std::vector<uint32_t> primitive_object;
+
+	private:
+		// Sum of node_cost over all nodes, kept up to date by the refits.
+		double cost_sum = 0;
+		double built_cost = 1;
+
+		// Only needed by refit_objects, so they are made the first time it is called.
+		std::vector<uint32_t> parent;
+		std::vector<uint32_t> leaf_of_slot;
+};
+
+linear_bvh::linear_bvh(const hittable_list& list, double time0, double time1, bvh_method method, int num_threads) {
+	if (list.objects.empty())
+		return;
+
+	auto prims = make_bvh_primitives(list.objects, time0, time1, num_threads);
+	auto order = identity_order(0, list.objects.size());
+	nodes.reserve(2 * prims.size());
+	if (method == bvh_method::lbvh || method == bvh_method::lbvh63) {
+		auto tree = build_lbvh(prims, order, method == bvh_method::lbvh ? 30 : 63, num_threads);
+		flatten_lbvh(tree, prims, order, (order.size() == 1) ? lbvh_leaf : 0);
+	} else if (method == bvh_method::sbvh) {
+		sbvh_builder sbvh(list.objects, prims);
+		for (const sbvh_node& built : sbvh.nodes) {
+			linear_bvh_node node;
+			set_node_box(node, built.box);
+			node.count = built.count;
+			node.axis = built.axis;
+			if (built.count > 0)
+				node.first_primitive = built.first;
+			else
+				node.second_child = built.second_child;
+			nodes.push_back(node);
+		}
+		order = std::move(sbvh.references);
+	} else {
+		build(prims, order, 0, order.size(), method, num_threads, 0, nodes);
+	}
+	nodes.shrink_to_fit();
+
+	// Leaves point at ranges of order, so the primitives go in that order.
+	primitives.reserve(order.size());
+	object_slot.resize(list.objects.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		primitives.push_back(list.objects[order[i]]);
+		object_slot[order[i]] = i;
+	}
+	if (order.size() > list.objects.size())
+		primitive_object = std::move(order);
+
+	for (const linear_bvh_node& node : nodes)
+		cost_sum += node_cost(node);
+	built_cost = cost_sum / node_box(nodes[0]).surface_area();
+}
+
+// Appends the subtree for order[start, end) to out in depth first order. Child indices
+// are relative to the start of out, so subtrees built into separate vectors on other
+// threads can be appended afterwards by shifting their second_child indices.
+void linear_bvh::build(const std::vector<bvh_primitive>& prims, std::vector<uint32_t>& order, size_t start, size_t end,
+                       bvh_method method, int num_threads, int depth, std::vector<linear_bvh_node>& out) const {
+	aabb box, centroid_bounds;
+	range_bounds(prims, order, start, end, box, centroid_bounds);
+
+	uint32_t index = out.size();
+	out.emplace_back();
+	set_node_box(out[index], box);
+
+	size_t mid;
+	int axis;
+	bool split;
+	if (end - start == 1)
+		split = false;
+	else if (method == bvh_method::median || depth >= bvh_max_depth / 2) {
+		// SAH can peel off a few objects at a time on odd inputs. Past half the stack depth,
+		// median splits guarantee the rest of the tree fits.
+		median_split(prims, order, start, end, mid, axis);
+		split = true;
+	} else
+		split = sah_split(prims, order, start, end, box, centroid_bounds, mid, axis);
+
+	if (!split) {
+		out[index].first_primitive = start;
+		out[index].count = end - start;
+		return;
+	}
+
+	out[index].count = 0;
+	out[index].axis = axis;
+
+	if (num_threads <= 1 || end - start < bvh_parallel_threshold) {
+		// NOTE :: don't hold a reference to out[index] across these calls, the vector can grow.
+		build(prims, order, start, mid, method, 1, depth + 1, out);
+		out[index].second_child = out.size();
+		build(prims, order, mid, end, method, 1, depth + 1, out);
+		return;
+	}
+
+	// The two halves touch disjoint parts of order, so they can be built at the same time.
+	int left_threads = num_threads / 2;
+	std::vector<linear_bvh_node> left_nodes, right_nodes;
+	task_group group;
+	group.run([&]() {
+		build(prims, order, start, mid, method, left_threads, depth + 1, left_nodes);
+	});
+	build(prims, order, mid, end, method, num_threads - left_threads, depth + 1, right_nodes);
+	group.wait();
+
+	auto append = [&out](const std::vector<linear_bvh_node>& subtree) {
+		uint32_t base = out.size();
+		for (linear_bvh_node node : subtree) {
+			if (node.count == 0)
+				node.second_child += base;
+			out.push_back(node);
+		}
+	};
+	append(left_nodes);
+	out[index].second_child = out.size();
+	append(right_nodes);
+}
+
+// Lays out the subtree of an lbvh_tree node (or leaf) depth first and returns its bounds.
+// Leaves have one object each.
+aabb linear_bvh::flatten_lbvh(const lbvh_tree& tree, const std::vector<bvh_primitive>& prims,
+                              const std::vector<uint32_t>& order, uint32_t ref) {
+	uint32_t index = nodes.size();
+	nodes.emplace_back();
+
+	aabb box;
+	if (ref & lbvh_leaf) {
+		uint32_t leaf = ref & ~lbvh_leaf;
+		box = prims[order[leaf]].box;
+		nodes[index].first_primitive = leaf;
+		nodes[index].count = 1;
+	} else {
+		aabb left_box = flatten_lbvh(tree, prims, order, tree.left[ref]);
+		nodes[index].second_child = nodes.size();
+		aabb right_box = flatten_lbvh(tree, prims, order, tree.right[ref]);
+		box = surrounding_box(left_box, right_box);
+		nodes[index].count = 0;
+
+		// The split axis is not stored with the codes, so use the axis the children are furthest
+		// apart on. Codes sort low to high, so the left child is on the low side of it like
+		// the near-first traversal expects.
+		vec3 d = right_box.centroid() - left_box.centroid();
+		int axis = (fabs(d.x()) > fabs(d.y())) ? 0 : 1;
+		if (fabs(d.z()) > fabs(d[axis])) axis = 2;
+		nodes[index].axis = axis;
+	}
+
+	set_node_box(nodes[index], box);
+	return box;
+}
+
+// NOTE :: leaves get the whole boxes of their objects, so the clipped boxes from an sbvh
+//         build are lost and its spatial splits stop paying off after a refit.
+void linear_bvh::refit(double time0, double time1, int num_threads) {
+	if (nodes.empty())
+		return;
+	if (primitives.size() < bvh_parallel_threshold)
+		num_threads = 1;
+
+	cost_sum = 0;
+	refit_node(0, time0, time1, num_threads, cost_sum);
+}
+
+// Refits the subtree under nodes[index], adds its cost to cost and returns its box.
+aabb linear_bvh::refit_node(uint32_t index, double time0, double time1, int num_threads, double& cost) {
+	// NOTE :: nodes never grows here, so holding a reference is fine.
+	linear_bvh_node& node = nodes[index];
+	if (node.count > 0) {
+		set_node_box(node, primitives_box(primitives, node.first_primitive, node.count, time0, time1));
+	} else if (num_threads <= 1) {
+		aabb left = refit_node(index + 1, time0, time1, 1, cost);
+		aabb right = refit_node(node.second_child, time0, time1, 1, cost);
+		set_node_box(node, surrounding_box(left, right));
+	} else {
+		// The two subtrees are disjoint ranges of nodes.
+		int left_threads = num_threads / 2;
+		double left_cost = 0;
+		aabb left;
+		task_group group;
+		group.run([&]() {
+			left = refit_node(index + 1, time0, time1, left_threads, left_cost);
+		});
+		aabb right = refit_node(node.second_child, time0, time1, num_threads - left_threads, cost);
+		group.wait();
+		cost += left_cost;
+		set_node_box(node, surrounding_box(left, right));
+	}
+
+	cost += node_cost(node);
+	return node_box(node);
+}
+
+void linear_bvh::refit_objects(double time0, double time1, const std::vector<uint32_t>& moved) {
+	if (nodes.empty())
+		return;
+
+	// object_slot only knows one of the leaves of a duplicated object.
+	if (!primitive_object.empty()) {
+		refit(time0, time1);
+		return;
+	}
+
+	if (parent.empty()) {
+		parent.resize(nodes.size());
+		leaf_of_slot.resize(primitives.size());
+		parent[0] = 0;
+		for (uint32_t i = 0; i < nodes.size(); ++i) {
+			if (nodes[i].count > 0) {
+				for (uint32_t j = nodes[i].first_primitive; j < nodes[i].first_primitive + nodes[i].count; ++j)
+					leaf_of_slot[j] = i;
+			} else {
+				parent[i + 1] = i;
+				parent[nodes[i].second_child] = i;
+			}
+		}
+	}
+
+	// Walk up from each moved object's leaf. Once a box comes out the same as before,
+	// nothing above it can change either.
+	for (uint32_t object : moved) {
+		uint32_t index = leaf_of_slot[object_slot[object]];
+		while (true) {
+			linear_bvh_node& node = nodes[index];
+			linear_bvh_node updated = node;
+			if (node.count > 0)
+				set_node_box(updated, primitives_box(primitives, node.first_primitive, node.count, time0, time1));
+			else
+				set_node_box(updated, surrounding_box(node_box(nodes[index + 1]), node_box(nodes[node.second_child])));
+
+			if (same_box(node_box(updated), node_box(node)))
+				break;
+
+			cost_sum += node_cost(updated) - node_cost(node);
+			node = updated;
+			if (index == 0)
+				break;
+			index = parent[index];
+		}
+	}
+}
+
+bool linear_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+
+	const point3 origin = r.origin();
+	const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+	const bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	bool hit_anything = false;
+	mailbox tested;
+	uint32_t stack[bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	// Counted here and added to the stats once, instead of on every node.
+	uint64_t visits = 0;
+
+	while (true) {
+		const linear_bvh_node& node = nodes[current];
+		++visits;
+
+		// Slab test, same as aabb::hit but with the inverse direction computed once per ray.
+		double t0 = t_min;
+		double t1 = t_max;
+		for (int a = 0; a < 3; ++a) {
+			double near = ((dir_is_neg[a] ? node.box_max[a] : node.box_min[a]) - origin[a]) * inv_dir[a];
+			double far  = ((dir_is_neg[a] ? node.box_min[a] : node.box_max[a]) - origin[a]) * inv_dir[a];
+			t0 = near > t0 ? near : t0;
+			t1 = far < t1 ? far : t1;
+		}
+
+		if (t0 <= t1) {
+			if (node.count > 0) {
+				for (uint32_t i = node.first_primitive; i < node.first_primitive + node.count; ++i) {
+					if (!primitive_object.empty() && tested.seen(primitive_object[i]))
+						continue;
+					if (primitives[i]->hit(r, t_min, t_max, rec)) {
+						hit_anything = true;
+						t_max = rec.t;
+					}
+				}
+			} else {
+				// Visit the child on the near side of the split first so t_max shrinks sooner.
+				if (dir_is_neg[node.axis]) {
+					stack[stack_size++] = current + 1;
+					current = node.second_child;
+				} else {
+					stack[stack_size++] = node.second_child;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+
+	COUNT_STAT(node_visits, visits);
+	return hit_anything;
+}
+
+// Same traversal as hit(), but any hit will do, so it returns as soon as it finds one.
+bool linear_bvh::occluded(const ray& r, double t_min, double t_max) const {
+	if (nodes.empty())
+		return false;
+
+	const point3 origin = r.origin();
+	const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+	const bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	uint32_t stack[bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	uint64_t visits = 0;
+
+	while (true) {
+		const linear_bvh_node& node = nodes[current];
+		++visits;
+
+		double t0 = t_min;
+		double t1 = t_max;
+		for (int a = 0; a < 3; ++a) {
+			double near = ((dir_is_neg[a] ? node.box_max[a] : node.box_min[a]) - origin[a]) * inv_dir[a];
+			double far  = ((dir_is_neg[a] ? node.box_min[a] : node.box_max[a]) - origin[a]) * inv_dir[a];
+			t0 = near > t0 ? near : t0;
+			t1 = far < t1 ? far : t1;
+		}
+
+		if (t0 <= t1) {
+			if (node.count > 0) {
+				for (uint32_t i = node.first_primitive; i < node.first_primitive + node.count; ++i) {
+					if (primitives[i]->occluded(r, t_min, t_max)) {
+						COUNT_STAT(node_visits, visits);
+						return true;
+					}
+				}
+			} else {
+				stack[stack_size++] = node.second_child;
+				current = current + 1;
+				continue;
+			}
+		}
+
+		if (stack_size == 0) {
+			COUNT_STAT(node_visits, visits);
+			return false;
+		}
+		current = stack[--stack_size];
+	}
+}
+
+bool linear_bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+	if (nodes.empty())
+		return false;
+
+	output_box = node_box(nodes[0]);
+	return true;
+}
+
+#endif
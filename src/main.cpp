@@ -1,4 +1,5 @@
 #include <iostream>
+#include <fstream>
 #include <unistd.h>
 
 #include <atomic>
@@ -6,11 +7,11 @@
 #include <mutex>
 #include <condition_variable>
 #include <future>
+#include <chrono>
 
 #include <argp.h>
 
 #include "common.h"
-#include "color.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "sphere.h"
@@ -18,9 +19,20 @@
 #include "camera.h"
 //#include "scenes.h" TODO UNCOMMENT
 #include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "instance.h"
 
 // My files
 #include "timer.h"
+#include "scheduler.h"
+#include "thread_pool.h"
+#include "framebuffer.h"
+#include "profiler.h"
+#include "ray_stats.h"
+#include "image_writer.h"
+#include "tile_writer.h"
+#include "stitch.h"
 //#include "demo_scenes.h" TODO UNCOMMENT
 
 // TEMP
@@ -31,24 +43,74 @@ const char *argp_program_version = "weekend-raytracing 0.2.2";
 const char *argp_program_bug_address = "<markofwisdumb@gmail.com>";
 static char doc[] = "Weekend Raytracing -- A personal ray-tracer based off of Peter Shirley's _Ray Tracing in One Weekend_ book series.";
 
+// Keys for options that only have a long name. They just need to be outside the range of printable characters.
+enum long_only_options {
+	OPT_BVH_WIDTH = 256,
+	OPT_FRAMES,
+	OPT_LIGHT_SAMPLES,
+	OPT_RNG,
+	OPT_SEED,
+	OPT_SAMPLER,
+	OPT_RR_DEPTH,
+	OPT_MAX_DIFFUSE,
+	OPT_MAX_SPECULAR,
+	OPT_MAX_VOLUME,
+	OPT_TILE_SIZE,
+	OPT_PIN_THREADS,
+	OPT_TRACE,
+	OPT_STATS,
+	OPT_EXR_FLOAT,
+	OPT_FRAMEBUFFER,
+	OPT_FLOAT_FRAMEBUFFER,
+	OPT_CROP,
+	OPT_TILE,
+	OPT_STITCH,
+	OPT_PASSES,
+	OPT_CHECKPOINT,
+	OPT_CHECKPOINT_EVERY,
+};
+
 static struct argp_option options[] = {
 	// Output options
-	// TODO :: specify image files of various formats instead of only using PPM and bash redirect
-	//{"output", 'o', "FILE", 0, "The file to save the resulting image to. NOTE: should be .ppm format in this version"},
+	{"output", 'o', "FILE", 0, "Save the image to FILE instead of writing text PPM to stdout. The extension picks the format -- .ppm, .png, or .exr for linear half float radiance. With more than one frame each frame gets its own numbered file.", 0},
+	{"exr-float", OPT_EXR_FLOAT, 0, 0, "Write 32 bit floats to EXR files instead of half floats.", 0},
+	{"framebuffer", OPT_FRAMEBUFFER, "FILE", 0, "Keep the image in FILE, mapped into memory, instead of in RAM. Only the rows being rendered and written stay in memory, so images far bigger than RAM can be rendered.", 0},
+	{"float-framebuffer", OPT_FLOAT_FRAMEBUFFER, 0, 0, "Keep the image as floats instead of doubles, in half the memory.", 0},
 	{"width", 'w', "WIDTH", 0, "Width of output image in pixels.", 0},
 	{"height", 'h', "HEIGHT", 0, "Height of output image in pixels.", 0},
+	{"crop", OPT_CROP, "X0,Y0,X1,Y1", 0, "Only render the pixels from X0,Y0 up to but not including X1,Y1, counting rows from the top. They come out exactly as they would in the whole image, and the output is just the cropped part.", 0},
+	{"tile", OPT_TILE, "I/N", 0, "Only render the I-th of N bands of rows, counting from 0 at the top -- one job's share of an image rendered by N jobs. Save each band with --framebuffer and put them together with --stitch.", 0},
+	{"stitch", OPT_STITCH, 0, 0, "Don't render anything, put together the framebuffer files given after the options -- parts saved by --crop or --tile runs -- into one image and save it with --output.", 0},
 	// Render options
 	// TODO :: specify scene files insead of hardcoded functions
 	{"scene", 's', "SCENE", 0, "Which scene to generate -- SCENE is an integer used in a switch statement.", 1},
+	{"frames", OPT_FRAMES, "N_FRAMES", 0, "Render N_FRAMES frames of animation one after another, each one unit of scene time long. Without --output the images are written to stdout back to back.", 1},
 	// Performance related
 	{"num-samples", 'n', "N_SAMPLES", 0, "Take a sample from each pixel N_SAMPLES times", 2},
 	{"max-depth", 'd', "MAX_DEPTH", 0, "MAX_DEPTH is the number of times a ray can be reflected.", 2},
+	{"max-diffuse", OPT_MAX_DIFFUSE, "N", 0, "Stop a path after N diffuse bounces. Default is MAX_DEPTH.", 2},
+	{"max-specular", OPT_MAX_SPECULAR, "N", 0, "Stop a path after N mirror or glass bounces. Default is MAX_DEPTH.", 2},
+	{"max-volume", OPT_MAX_VOLUME, "N", 0, "Stop a path after N scatters inside a volume. Default is MAX_DEPTH.", 2},
+	{"rr-depth", OPT_RR_DEPTH, "N", 0, "Start russian roulette after N bounces (default 5). Paths carrying little light are stopped early, without changing the average. Set it to MAX_DEPTH to turn it off.", 2},
+	{"light-samples", OPT_LIGHT_SAMPLES, "N", 0, "Cast N shadow rays at the lights from every diffuse bounce. 0 (default) aims one bounce ray at the lights or along the material instead.", 2},
+	{"sampler", OPT_SAMPLER, "SAMPLER", 0, "How the samples of a pixel are spread out -- 'independent' (default), 'stratified', 'sobol', 'halton' or 'bluenoise'. The last four reach the same noise with fewer samples.", 2},
+	{"rng", OPT_RNG, "MODE", 0, "Random numbers for the independent sampler -- 'xoshiro' (default) gives the same image for the same seed and tile size, 'hash' gives the same image for any tile size.", 2},
+	{"seed", OPT_SEED, "SEED", 0, "Seed for the random numbers used while rendering. Default is 0.", 2},
 	{"num-threads", 't', "N_THREADS", 0, "Create N_THREADS threads to render the image in parallel. Default is estimated number of cores.", 2},
+	{"passes", OPT_PASSES, "N", 0, "Take the samples of each pixel in N passes over the whole image (default 1), so the render can be checkpointed between them.", 2},
+	{"checkpoint", OPT_CHECKPOINT, "FILE", 0, "Save the render to FILE after each frame and, with --passes, between passes. If FILE already holds a checkpoint of the same render, carry on from it -- a job that was killed can just be started again. If it had already finished, the last frame is written again.", 2},
+	{"checkpoint-every", OPT_CHECKPOINT_EVERY, "SECONDS", 0, "Save a checkpoint between passes once SECONDS have gone by since the last one (default 600).", 2},
+	{"tile-size", OPT_TILE_SIZE, "SIZE", 0, "Render the image in SIZE x SIZE pixel tiles (default 32). Threads that run out of tiles take them from the others.", 2},
+	{"pin-threads", OPT_PIN_THREADS, 0, 0, "Keep each thread on its own cpu, so it doesn't lose its cache to the scheduler moving it around.", 2},
+	{"bvh", 'b', "METHOD", 0, "How to build the bounding volume hierarchy -- 'sah' (default), 'median', 'sbvh' for meshes with long thin triangles, or 'lbvh'/'lbvh63' for a fast Morton code build of huge scenes.", 2},
+	{"bvh-width", OPT_BVH_WIDTH, "WIDTH", 0, "Children per bounding volume hierarchy node -- 2, 4 or 8 (default). 4 and 8 test all children at once with SSE/AVX.", 2},
 	// TODO :: should this be a runtime flag or a compile time flag? 
 	//         I guess I can try both and see how much it changes the performance. Or not... do I really need the other algorithm?
 	// {"moller-trumbore", 'm', 0, 0, "Flag determining which triangle hit algorithm to use -- Moller Trombore or the other one... (what's it called?)", 1},
 	// Debugging related
 	{"verbose", 'v', 0, 0, "Verbose output. Prints extra info while rendering.", 3},
+	{"trace", OPT_TRACE, "FILE", 0, "Time every phase of the run and every tile on every thread, and save it to FILE as a Chrome trace (open it in chrome://tracing or Perfetto).", 3},
+	{"stats", OPT_STATS, "FILE", OPTION_ARG_OPTIONAL, "Count rays, bvh nodes visited and primitives tested, and print a summary after every frame. With FILE, also save the counts there as JSON.", 3},
 	// TODO :: implement proper logging capability.
 	// {"logfile",         'l', 0, 0, "The file to which log messages will be sent", 2},
 	{0} // This needs to be here to argp knows where the options list ends.
@@ -57,9 +119,37 @@ static struct argp_option options[] = {
 struct arguments
 {
 	int scene;
+	int frames;
 	int image_width, image_height;
 	int samples_per_pixel, max_depth, num_threads;
+	int light_samples;
+	int max_diffuse, max_specular, max_volume, rr_depth;
+	int tile_size;
+	int pin_threads;
+	sampler_type sampler;
+	rng_mode rng;
+	uint64_t seed;
+	bvh_method bvh;
+	int bvh_width;
 	int verbose;
+	const char* trace_file;
+	int stats;
+	const char* output_file;
+	image_format output_format;
+	int exr_float;
+	const char* framebuffer_file;
+	int float_framebuffer;
+	const char* stats_file;
+	// Set when --crop or --tile was given.
+	int crop;
+	image_region crop_region;
+	int tile_band, tile_bands;
+	int stitch;
+	char** parts;
+	int num_parts;
+	int passes;
+	const char* checkpoint_file;
+	double checkpoint_every;
 };
 
 static error_t parse_opt(int key, char *arg, argp_state *state)
@@ -87,6 +177,128 @@ static error_t parse_opt(int key, char *arg, argp_state *state)
 	case 't':
 		args->num_threads = atoi(arg);
 		break;
+	case 'b':
+		if (!parse_bvh_method(arg, args->bvh))
+			argp_error(state, "unknown bvh method '%s'", arg);
+		break;
+	case OPT_LIGHT_SAMPLES:
+		args->light_samples = atoi(arg);
+		if (args->light_samples < 0)
+			argp_error(state, "light samples can't be negative");
+		break;
+	case OPT_MAX_DIFFUSE:
+		args->max_diffuse = atoi(arg);
+		if (args->max_diffuse < 0)
+			argp_error(state, "diffuse bounce limit can't be negative");
+		break;
+	case OPT_MAX_SPECULAR:
+		args->max_specular = atoi(arg);
+		if (args->max_specular < 0)
+			argp_error(state, "specular bounce limit can't be negative");
+		break;
+	case OPT_MAX_VOLUME:
+		args->max_volume = atoi(arg);
+		if (args->max_volume < 0)
+			argp_error(state, "volume scatter limit can't be negative");
+		break;
+	case OPT_RR_DEPTH:
+		args->rr_depth = atoi(arg);
+		if (args->rr_depth < 0)
+			argp_error(state, "russian roulette depth can't be negative");
+		break;
+	case OPT_TILE_SIZE:
+		args->tile_size = atoi(arg);
+		if (args->tile_size < 1)
+			argp_error(state, "tile size must be at least 1");
+		break;
+	case OPT_SAMPLER:
+		if (!parse_sampler_type(arg, args->sampler))
+			argp_error(state, "unknown sampler '%s'", arg);
+		break;
+	case OPT_RNG:
+		if (!parse_rng_mode(arg, args->rng))
+			argp_error(state, "unknown rng mode '%s'", arg);
+		break;
+	case OPT_SEED:
+		args->seed = strtoull(arg, nullptr, 10);
+		break;
+	case OPT_FRAMES:
+		args->frames = atoi(arg);
+		if (args->frames < 1)
+			argp_error(state, "need at least one frame");
+		break;
+	case OPT_BVH_WIDTH:
+		args->bvh_width = atoi(arg);
+		if (args->bvh_width != 2 && args->bvh_width != 4 && args->bvh_width != 8)
+			argp_error(state, "bvh width must be 2, 4 or 8");
+		break;
+	case OPT_PIN_THREADS:
+		args->pin_threads = 1;
+		break;
+	case 'o':
+		args->output_file = arg;
+		if (!image_format_from_filename(arg, args->output_format))
+			argp_error(state, "can't tell the image format of '%s' -- use .ppm, .png or .exr", arg);
+		break;
+	case OPT_EXR_FLOAT:
+		args->exr_float = 1;
+		break;
+	case OPT_FRAMEBUFFER:
+		args->framebuffer_file = arg;
+		break;
+	case OPT_FLOAT_FRAMEBUFFER:
+		args->float_framebuffer = 1;
+		break;
+	case OPT_CROP:
+	{
+		image_region& r = args->crop_region;
+		if (args->tile_bands || sscanf(arg, "%d,%d,%d,%d", &r.x0, &r.y0, &r.x1, &r.y1) != 4)
+			argp_error(state, "crop must be X0,Y0,X1,Y1, and can't go with --tile");
+		if (r.x0 < 0 || r.y0 < 0 || r.x1 <= r.x0 || r.y1 <= r.y0)
+			argp_error(state, "crop '%s' is empty", arg);
+		args->crop = 1;
+		break;
+	}
+	case OPT_TILE:
+		if (args->crop || sscanf(arg, "%d/%d", &args->tile_band, &args->tile_bands) != 2)
+			argp_error(state, "tile must be I/N, and can't go with --crop");
+		if (args->tile_bands < 1 || args->tile_band < 0 || args->tile_band >= args->tile_bands)
+			argp_error(state, "tile '%s' needs 0 <= I < N", arg);
+		break;
+	case OPT_STITCH:
+		args->stitch = 1;
+		break;
+	case OPT_PASSES:
+		args->passes = atoi(arg);
+		if (args->passes < 1)
+			argp_error(state, "need at least one pass");
+		break;
+	case OPT_CHECKPOINT:
+		args->checkpoint_file = arg;
+		break;
+	case OPT_CHECKPOINT_EVERY:
+	{
+		char* end;
+		args->checkpoint_every = strtod(arg, &end);
+		if (end == arg || *end != '\0' || !(args->checkpoint_every >= 0))
+			argp_error(state, "checkpoint interval must be a number of seconds, not '%s'", arg);
+		break;
+	}
+	case ARGP_KEY_ARGS:
+		args->parts = state->argv + state->next;
+		args->num_parts = state->argc - state->next;
+		break;
+	case ARGP_KEY_END:
+		if (args->num_parts && !args->stitch)
+			argp_error(state, "only --stitch takes files without an option");
+		break;
+	case OPT_STATS:
+		args->stats = 1;
+		args->stats_file = arg;
+		break;
+	case OPT_TRACE:
+		args->trace_file = arg;
+		break;
 	case 'v':
 		args->verbose = 1;
 		break;
@@ -102,51 +314,299 @@ static error_t parse_opt(int key, char *arg, argp_state *state)
 	return 0;
 }
 
-static struct argp argp = {options, parse_opt, 0, doc};
+static char args_doc[] = "[--stitch PART...]";
+
+static struct argp argp = {options, parse_opt, args_doc, doc};
 
-// This struct is used for multithreading
+// This struct is used by the line renderer in render()
 struct pixel_data
 {
 	color col;
 	unsigned int index;
 };
 
-color ray_color(const ray& r, const color& background,
-                const hittable& world, shared_ptr<hittable> lights, int depth)
+// Build the acceleration structure the whole scene is rendered through.
+shared_ptr<refittable_bvh> build_bvh(const hittable_list& world, double time0, double time1,
+                                     bvh_method method, int width, int num_threads)
+{
+	auto binary = make_shared<linear_bvh>(world, time0, time1, method, num_threads);
+	if (width == 4)
+		return make_shared<wide_bvh<4>>(*binary);
+	if (width == 8)
+		return make_shared<wide_bvh<8>>(*binary);
+	return binary;
+}
+
+// Multiple importance sampling weight (power heuristic) for a sample from strategy f,
+// when nf samples are taken from f and ng from g.
+inline double power_heuristic(int nf, double f_pdf, int ng, double g_pdf)
 {
-	hit_record rec;
+	double f = nf * f_pdf;
+	double g = ng * g_pdf;
+	return (f * f) / (f * f + g * g);
+}
 
-	if (depth <= 0)
+// Light reaching a diffuse hit straight from the lights, from light_samples shadow rays.
+// A shadow ray only has to know whether something is in the way, so it uses occluded().
+color direct_light(const ray& r, const hit_record& rec, const scatter_record& srec,
+                   const hittable& world, const hittable_list& lights, int light_samples)
+{
+	color direct(0, 0, 0);
+	for (int i = 0; i < light_samples; ++i)
 	{
-		return color(0, 0, 0);
-	}
+		ray to_light(rec.p, lights.random(rec.p), r.time());
+		hit_record light_rec;
+		if (!lights.hit(to_light, 0.001, infinity, light_rec))
+			continue;
+		light_rec.resolve(to_light);
+		if (!light_rec.mat_ptr)
+			continue;
 
-	if (!world.hit(r, 0.001, infinity, rec))
-		return background;
+		color light = light_rec.mat_ptr->emitted(to_light, light_rec, light_rec.u, light_rec.v, light_rec.p);
+		double scattering = rec.mat_ptr->scattering_pdf(r, rec, to_light);
+		if (scattering <= 0 || (light.x() <= 0 && light.y() <= 0 && light.z() <= 0))
+			continue;
 
-	scatter_record srec;
-	color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+		// Stop just short of the light, or the light itself would be in the way.
+		COUNT_STAT(shadow_rays, 1);
+		if (world.occluded(to_light, 0.001, light_rec.t * (1 - 1e-4)))
+			continue;
 
-	if (!rec.mat_ptr->scatter(r, rec, srec))
-		return emitted;
+		double light_pdf = lights.pdf_value(rec.p, to_light.direction());
+		double weight = power_heuristic(light_samples, light_pdf, 1, srec.pdf.value(to_light.direction()));
+		direct += srec.attenuation * scattering * light * weight / (light_pdf * light_samples);
+	}
+	return direct;
+}
+
+// How long a path may get. A path stops at whichever limit it reaches first.
+struct path_limits
+{
+	int max_depth;    // rays per path, counting the camera ray
+	int max_diffuse;  // bounces off each kind of surface
+	int max_specular;
+	int max_volume;
+	int rr_depth;     // bounces before russian roulette starts
+	int light_samples;
+};
+
+// Follows one path from the camera, adding up the light it picks up on the way.
+// throughput is the fraction of the light found at the current hit that makes it back
+// to the camera.
+color ray_color(const ray& camera_ray, const color& background,
+                const hittable& world, const hittable_list& lights, const path_limits& limits)
+{
+	color radiance(0, 0, 0);
+	color throughput(1, 1, 1);
+	ray r = camera_ray;
+	// The pdf the material picked r with at the last bounce when light sampling is on, and
+	// 0 otherwise (camera rays, specular bounces, or light_samples == 0).
+	double scatter_pdf = 0;
+	int diffuse_bounces = 0, specular_bounces = 0, volume_bounces = 0;
 
-	if(srec.is_specular)
+	for (int depth = 0; depth < limits.max_depth; ++depth)
 	{
-		return srec.attenuation * ray_color(srec.specular_ray, background, world, lights, depth - 1);
-	}
+		hit_record rec;
+		if (depth == 0)
+			COUNT_STAT(camera_rays, 1);
+		else
+			COUNT_STAT(bounce_rays, 1);
+		if (!world.hit(r, 0.001, infinity, rec))
+		{
+			radiance += throughput * background;
+			break;
+		}
+		rec.resolve(r);
+
+		scatter_record srec;
+		color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
 
-	auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-	mixture_pdf mix_pdf(light_ptr, srec.pdf_ptr);
+		// This light could also have been found by a shadow ray at the last bounce, so it only
+		// gets its share of the two estimates.
+		if (scatter_pdf > 0)
+			emitted = emitted * power_heuristic(1, scatter_pdf, limits.light_samples, lights.pdf_value(r.origin(), r.direction()));
+		radiance += throughput * emitted;
 
-	ray scattered = ray(rec.p, mix_pdf.generate(), r.time());
-	auto pdf_val = mix_pdf.value(scattered.direction());
+		if (!rec.mat_ptr->scatter(r, rec, srec))
+			break;
 
-	return emitted
-				 + srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-									* ray_color(scattered, background, world, lights, depth - 1) / pdf_val;
+		if (srec.is_specular)
+		{
+			int& bounces = srec.is_volume ? volume_bounces : specular_bounces;
+			if (++bounces > (srec.is_volume ? limits.max_volume : limits.max_specular))
+				break;
+			throughput = throughput * srec.attenuation;
+			r = srec.specular_ray;
+			scatter_pdf = 0;
+		}
+		else
+		{
+			if (++diffuse_bounces > limits.max_diffuse)
+				break;
+
+			ray scattered;
+			double pdf_val;
+			if (lights.objects.empty())
+			{
+				scattered = ray(rec.p, srec.pdf.generate(), r.time());
+				pdf_val = srec.pdf.value(scattered.direction());
+				scatter_pdf = 0;
+			}
+			else if (limits.light_samples > 0)
+			{
+				// Next event estimation -- shadow rays for the direct light, and the material picks
+				// the direction the path goes on in.
+				radiance += throughput * direct_light(r, rec, srec, world, lights, limits.light_samples);
+
+				scattered = ray(rec.p, srec.pdf.generate(), r.time());
+				pdf_val = srec.pdf.value(scattered.direction());
+				scatter_pdf = pdf_val;
+			}
+			else
+			{
+				mixture_pdf<hittable_pdf, cosine_pdf> mix_pdf(hittable_pdf(lights, rec.p), srec.pdf);
+
+				scattered = ray(rec.p, mix_pdf.generate(), r.time());
+				pdf_val = mix_pdf.value(scattered.direction());
+				scatter_pdf = 0;
+			}
+			if (pdf_val <= 0)
+				break;
+
+			throughput = throughput * srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered) / pdf_val;
+			r = scattered;
+		}
+
+		// Russian roulette -- a path that can only add a little more light is stopped early
+		// with probability q, and the ones that go on make up for it by counting 1/(1-q) times.
+		if (depth + 1 >= limits.rr_depth)
+		{
+			double q = fmax(0.0, 1.0 - fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+			if (random_double() < q)
+				break;
+			throughput = throughput / (1 - q);
+		}
+	}
+	return radiance;
 }
 
 
+// Renders one image of the scene into fb, which holds the average radiance of each pixel --
+// of the whole image, or of the region of it that fb covers. fb.start_frame() has to be
+// called first. Returns how long it took.
+//
+// Takes samples_per_pixel samples of each pixel, numbered from first_sample. A progressive
+// render calls this once per pass, and after the first pass the new samples are averaged in
+// with the first_sample that fb already holds.
+double render(const camera& cam, const hittable& world, const hittable_list& lights, const color& background,
+            framebuffer& fb, int first_sample, int samples_per_pixel, const path_limits& limits,
+            const sampler_settings& sampling, int thread_count, int tile_size, bool verbose)
+{
+	scoped_phase render_phase("render");
+	const int image_width = fb.image_width;
+	const int image_height = fb.image_height;
+	const image_region region = fb.region();
+	tile_scheduler scheduler(image_width, image_height, tile_size, thread_count, region);
+	timer wall;
+	wall.start();
+
+#if 0 // Render by lines (Useless with multithreading because I can't actually create enough threads in Linux)
+	std::mutex mutex;
+	std::condition_variable pixels_cv;
+
+	int num_pixels = image_width * image_height;
+
+	std::vector<std::future<pixel_data>> pixel_futures;
+	std::cerr << "Rendering...\n";
+	for(int y = image_height - 1; y >= 0; --y)
+	{
+		std::cerr << "\r" << y << " lines remaining." << std::flush;
+		for(int x = 0; x < image_width; ++x)
+		{
+		// Make a future for each pixel
+			auto future = std::async(std::launch::async,// | std::launch::deferred,
+			[&cam, &world, &lights, &background, &limits, &samples_per_pixel,
+			x, y, image_width, image_height, &pixels_cv]() -> pixel_data {
+						const unsigned int index = (y * image_width) + x;
+						color pixel_color(0, 0, 0);
+						for(int s = 0; s < samples_per_pixel; ++s)
+						{
+							float u = float(x + random_double()) / float(image_width - 1);
+							float v = float(y + random_double()) / float(image_height - 1);
+							ray r = cam.get_ray(u, v);
+							pixel_color += ray_color(r, background, world, lights, limits);
+						}
+						pixel_data pixel = {};
+						pixel.col = pixel_color / samples_per_pixel;
+						pixel.index = index;
+						return pixel;
+					}
+			);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pixel_futures.push_back(std::move(future));
+			}
+		}
+	}
+
+	// Wait until each pixel has been created
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		pixels_cv.wait(lock, [&pixel_futures, &num_pixels] { 
+							return pixel_futures.size() == num_pixels;
+		});
+	}
+
+	// Get each pixel from the vector of futures and order them
+	for(std::future<pixel_data>& pd : pixel_futures)
+	{
+		pixel_data pixel = pd.get();
+		fb.store(pixel.index % image_width, image_height - 1 - pixel.index / image_width, pixel.col);
+	}
+	wall.stop();
+#else // Render by tiles
+	std::vector<worker_stats> stats = scheduler.run(
+		[&](int, const tile& t) {
+			scoped_phase tile_phase("tile", t.index);
+			pixel_sampler& sampler = this_thread_sampler();
+			// Each pass of a tile needs its own random numbers.
+			sampler.start_tile(sampling, first_sample ? hash_combine(t.index, first_sample) : t.index);
+			for (int row = t.y0; row < t.y1; ++row)
+			{
+				// Tiles count rows from the top, the camera from the bottom.
+				int y = image_height - 1 - row;
+				for (int x = t.x0; x < t.x1; ++x)
+				{
+					unsigned int index = (y * image_width) + x;
+					color pixel_color(0, 0, 0);
+					for (int s = 0; s < samples_per_pixel; ++s)
+					{
+						sampler.start_sample(x, y, index, first_sample + s);
+						auto u = double(x + random_double()) / (image_width - 1);
+						auto v = double(y + random_double()) / (image_height - 1);
+						ray r = cam.get_ray(u, v);
+						pixel_color += ray_color(r, background, world, lights, limits);
+					}
+					// The pixels of a tile outside a crop are rendered all the same, so the ones
+					// inside get the same random numbers as in the whole image.
+					if (!region.contains(x, row))
+						continue;
+					const int total = first_sample + samples_per_pixel;
+					color average = pixel_color * (1.0 / total);
+					if (first_sample)
+						average += fb.load(x - region.x0, row - region.y0) * (double(first_sample) / total);
+					fb.store(x - region.x0, row - region.y0, average);
+				}
+			}
+			fb.finish_tile(t);
+		});
+	wall.stop();
+	report_utilization(stats, wall.duration_ms(), scheduler.num_tiles, verbose);
+#endif
+	return wall.duration_ms();
+}
+
 int main(int argc, char *argv[])
 {
 	nice(1);
@@ -157,11 +617,51 @@ int main(int argc, char *argv[])
 	arguments.image_width = 480;
 	arguments.image_height = 480;
 	arguments.scene = -1;
+	arguments.frames = 1;
 	arguments.samples_per_pixel = 10;
 	arguments.max_depth = 50;
+	arguments.max_diffuse = -1;
+	arguments.max_specular = -1;
+	arguments.max_volume = -1;
+	arguments.rr_depth = 5;
+	arguments.tile_size = 32;
+	arguments.passes = 1;
+	arguments.checkpoint_every = 600;
 	arguments.num_threads = std::thread::hardware_concurrency() / 2;
+	arguments.bvh = bvh_method::sah;
+	arguments.bvh_width = 8;
 
 	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+	// hardware_concurrency() can be 0 or 1, which would leave no threads at all.
+	if (arguments.num_threads < 1)
+		arguments.num_threads = 1;
+
+	if (arguments.stitch)
+	{
+		std::vector<const char*> parts(arguments.parts, arguments.parts + arguments.num_parts);
+		auto whole = stitch_framebuffers(parts, arguments.float_framebuffer != 0, arguments.framebuffer_file);
+		if (!whole)
+			return 1;
+		if (!arguments.output_file)
+			write_image(std::cout, *whole, image_format::ppm_text, false);
+		else if (!write_image(arguments.output_file, *whole, arguments.output_format, arguments.exr_float != 0))
+		{
+			std::cerr << "ERROR: could not write the image to '" << arguments.output_file << "'.\n";
+			return 1;
+		}
+		std::cerr << "Stitched " << parts.size() << " parts into a " << whole->width << "x" << whole->height << " image.\n";
+		return 0;
+	}
+
+	// The same threads build the bvh and render every frame. This thread is one of them.
+	worker_pool().start(arguments.num_threads - 1, arguments.pin_threads != 0);
+	if (arguments.trace_file)
+		run_profiler().enable();
+	render_stats().enabled = arguments.stats != 0;
+#if !RT_STATS
+	if (arguments.stats)
+		std::cerr << "This build has no stats counters, it was compiled with RT_STATS=0.\n";
+#endif
 
 	// Store values from arguments in primitives so I don't have to refer to arguments all the time
 	// (((Is this dumb?)))
@@ -181,12 +681,12 @@ int main(int argc, char *argv[])
 	hittable_list world;
 	color background(0, 0, 0);
 
-  auto lights = make_shared<hittable_list>();
-	lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
-	lights->add(make_shared<sphere>(point3(190, 90, 190), 90, shared_ptr<material>()));
+	// Objects to aim rays at -- the scene's lights, and anything else worth sampling directly.
+	auto lights = make_shared<hittable_list>();
 
 	timer t;
 	t.start();
+	scoped_phase scene_phase("scene");
 	switch(arguments.scene) {
 		/* TODO DELETE THIS
 	case 1:
@@ -278,7 +778,7 @@ int main(int argc, char *argv[])
 		break;
 		*/ // TODO DELETE THIS
 	case 11:
-		world = lambertian_cornell_box();
+		world = lambertian_cornell_box(*lights);
 		background = color(0, 0, 0);
 
 		max_depth = 50;
@@ -289,6 +789,30 @@ int main(int argc, char *argv[])
 		lookat = point3(278, 278, 0);
 		vfov = 40.0;
 		break;
+	case 12:
+		world = instanced_forest();
+		background = color(0.7, 0.8, 1.0);
+
+		lookfrom = point3(0, 6, -110);
+		lookat = point3(0, 2, 0);
+		vfov = 50.0;
+		break;
+	case 13:
+		world = cornell_smoke(*lights);
+		background = color(0, 0, 0);
+
+		lookfrom = point3(278, 278, -800);
+		lookat = point3(278, 278, 0);
+		vfov = 40.0;
+		break;
+	case 14:
+		world = drifting_balls();
+		background = color(0.7, 0.8, 1.0);
+
+		lookfrom = point3(0, 8, -80);
+		lookat = point3(0, 2, 0);
+		vfov = 50.0;
+		break;
 		/* TODO DELETE THIS
 	default:
 		world = cornell_box();
@@ -301,8 +825,36 @@ int main(int argc, char *argv[])
 		DELETE THIS */
 	}
 
+	// Chains of translate/rotate wrappers become single instances with one matrix.
+	world = flatten_transforms(world);
+
 	auto aspect_ratio = (double)image_width / (double)image_height;
 
+	// What part of the image to render. The camera still sees the whole image, only the rays
+	// of the pixels outside the region aren't traced.
+	image_region region = { 0, 0, image_width, image_height };
+	if (arguments.crop)
+	{
+		region = arguments.crop_region;
+		if (region.x1 > image_width || region.y1 > image_height)
+		{
+			std::cerr << "ERROR: the crop doesn't fit in the " << image_width << "x" << image_height << " image.\n";
+			return 1;
+		}
+	}
+	else if (arguments.tile_bands)
+	{
+		// Whole rows of tiles, so no tile is split between two jobs.
+		int tile_rows = (image_height + arguments.tile_size - 1) / arguments.tile_size;
+		if (arguments.tile_bands > tile_rows)
+		{
+			std::cerr << "ERROR: the image only has " << tile_rows << " rows of tiles to share out.\n";
+			return 1;
+		}
+		region.y0 = arguments.tile_band * tile_rows / arguments.tile_bands * arguments.tile_size;
+		region.y1 = std::min((arguments.tile_band + 1) * tile_rows / arguments.tile_bands * arguments.tile_size, image_height);
+	}
+
 	camera cam(lookfrom, lookat,
 				vup, vfov,
 				aspect_ratio,
@@ -312,198 +864,215 @@ int main(int argc, char *argv[])
 	t.stop();
 	std::cerr << "It took " << t.duration_ms() << 
 				 " milliseconds to load the scene and camera.\n";
+	scene_phase.end();
 
 	// Create bounding volume hierarchy to speed up collision detection
 	// Should I leave this here or should I let scene functions create the bvh?
 	t.start();
-	bvh_node bvh(world, 0.0, 1.0);
+	scoped_phase bvh_phase("bvh build");
+	shared_ptr<refittable_bvh> bvh = build_bvh(world, 0.0, 1.0, arguments.bvh, arguments.bvh_width, arguments.num_threads);
+	// The objects whose boxes change with time. They are all a refit has to look at.
+	std::vector<uint32_t> moving;
+	for (uint32_t i = 0; i < world.objects.size(); ++i)
+		if (world.objects[i]->moves())
+			moving.push_back(i);
 	t.stop();
 	std::cerr << "It took " << t.duration_ms() << 
-				 " milliseconds to create the bounding volume hierarchy.\n";
+				 " milliseconds to create the bounding volume hierarchy (" << world.objects.size() <<
+				 " objects, " << arguments.num_threads << " threads).\n";
+	bvh_phase.end();
 
-	t.start();
-	std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-	color *pixels = (color *)malloc((image_width * image_height) * sizeof(color));
+	// The per event limits default to the overall one.
+	auto limit_or_depth = [max_depth](int limit) { return limit < 0 ? max_depth : limit; };
+	path_limits limits = { max_depth, limit_or_depth(arguments.max_diffuse), limit_or_depth(arguments.max_specular),
+	                       limit_or_depth(arguments.max_volume), arguments.rr_depth, arguments.light_samples };
 
-	std::mutex mutex;
-	std::condition_variable pixels_cv;
+	std::ofstream stats_json;
+	if (arguments.stats_file)
+	{
+		stats_json.open(arguments.stats_file);
+		if (!stats_json)
+			std::cerr << "ERROR: could not write the stats to '" << arguments.stats_file << "'.\n";
+		stats_json << "[\n";
+	}
 
-	int num_pixels = image_width * image_height;
+	framebuffer fb(image_width, image_height, region, arguments.tile_size, arguments.float_framebuffer != 0, arguments.framebuffer_file);
 
-#if 0 // Render by lines (Useless with multithreading because I can't actually create enough threads in Linux)
-	std::vector<std::future<pixel_data>> pixel_futures;
-	std::cerr << "Rendering...\n";
-	for(int y = image_height - 1; y >= 0; --y)
+	// Pass p takes samples [p * spp / passes, (p + 1) * spp / passes) of every pixel.
+	const int passes = std::min(arguments.passes, samples_per_pixel);
+	render_progress progress = { arguments.seed, 0, 0 };
+	if (arguments.checkpoint_file)
 	{
-		std::cerr << "\r" << y << " lines remaining." << std::flush;
-		for(int x = 0; x < image_width; ++x)
+		// Everything that changes the pixels. The size of the image and the crop are in the
+		// checkpoint already.
+		for (uint64_t setting : { uint64_t(arguments.scene), uint64_t(arguments.tile_size), uint64_t(samples_per_pixel),
+		                          uint64_t(passes), uint64_t(arguments.sampler), uint64_t(arguments.rng), uint64_t(limits.max_depth),
+		                          uint64_t(limits.max_diffuse), uint64_t(limits.max_specular), uint64_t(limits.max_volume),
+		                          uint64_t(limits.rr_depth), uint64_t(limits.light_samples), uint64_t(arguments.bvh),
+		                          uint64_t(arguments.bvh_width) })
+			progress.settings = hash_combine(progress.settings, setting);
+		if (access(arguments.checkpoint_file, F_OK) == 0)
 		{
-		// Make a future for each pixel
-			auto future = std::async(std::launch::async,// | std::launch::deferred,
-			[&cam, &bvh, &background, &max_depth, &samples_per_pixel,
-			x, y, image_width, image_height, &pixels_cv]() -> pixel_data {
-						const unsigned int index = (y * image_width) + x;
-						color pixel_color(0, 0, 0);
-						for(int s = 0; s < samples_per_pixel; ++s)
-						{
-							float u = float(x + random_double()) / float(image_width - 1);
-							float v = float(y + random_double()) / float(image_height - 1);
-							ray r = cam.get_ray(u, v);
-							pixel_color += ray_color(r, background, bvh, max_depth);
-						}
-						pixel_data pixel = {};
-						pixel.col = normalize(pixel_color, samples_per_pixel);
-						pixel.index = index;
-						return pixel;
-					}
-			);
-
-			{
-				std::lock_guard<std::mutex> lock(mutex);
-				pixel_futures.push_back(std::move(future));
-			}
+			if (fb.load_checkpoint(arguments.checkpoint_file, progress))
+				std::cerr << "Resuming from the checkpoint at frame " << progress.frame << ", sample " << progress.samples << ".\n";
+			else
+				std::cerr << "WARNING: '" << arguments.checkpoint_file << "' is not a checkpoint of this render, starting over.\n";
 		}
 	}
-
-	// Wait until each pixel has been created
+	auto last_checkpoint = std::chrono::steady_clock::now();
+	auto save_checkpoint = [&](int frame, int samples) {
+		progress.frame = frame;
+		progress.samples = samples;
+		scoped_phase checkpoint_phase("checkpoint", frame);
+		if (!fb.save_checkpoint(arguments.checkpoint_file, progress))
+			std::cerr << "ERROR: could not save the checkpoint to '" << arguments.checkpoint_file << "'.\n";
+		last_checkpoint = std::chrono::steady_clock::now();
+	};
+	const int first_frame = progress.frame;
+	const int resume_samples = progress.samples;
+	if (first_frame >= arguments.frames)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		pixels_cv.wait(lock, [&pixel_futures, &num_pixels] { 
-							return pixel_futures.size() == num_pixels;
-		});
+		// fb holds the last frame, as it was saved. The frames before it are only in the
+		// images they were written to.
+		if (first_frame > arguments.frames)
+		{
+			std::cerr << "ERROR: the checkpoint is of frame " << first_frame - 1 << ", past the last of " << arguments.frames << " frames.\n";
+			return 1;
+		}
+		std::cerr << "Every frame was already rendered before the checkpoint, writing the last one again.\n";
+		if (!arguments.output_file)
+			write_image(std::cout, fb, image_format::ppm_text, false);
+		else
+		{
+			std::string filename = frame_filename(arguments.output_file, arguments.frames - 1, arguments.frames);
+			if (!write_image(filename, fb, arguments.output_format, arguments.exr_float != 0))
+			{
+				std::cerr << "ERROR: could not write the image to '" << filename << "'.\n";
+				return 1;
+			}
+		}
+		// Nothing left to render, so no point refitting the bvh for every frame.
+		if (stats_json.is_open())
+			stats_json << "]\n";
+		std::cerr << "DONE.\n";
+		return 0;
 	}
 
-	// Get each pixel from the vector of futures and order them
-	for(std::future<pixel_data>& pd : pixel_futures)
+	for (int frame = 0; frame < arguments.frames; ++frame)
 	{
-		pixel_data pixel = pd.get();
-		pixels[pixel.index] = pixel.col;
-	}
-#else // Render by chunks
-	// NOTE :: this version has a vector of futures of type vector of pixel_data...
-	//         this feels like it will be a bit slower than the original version. But I'll test it.
-	//         I have to do this because each chunk is rendering multiple pixels in it's own thread,
-	//         which means async() cannot return each pixel individually - it has to return all of the pixels
-	//         at once.
-	//         Maybe there's a better way to implement multithreading here. Think about it.
-	std::vector<std::future<std::vector<pixel_data>>> pixel_futures;
-
-	int thread_count = arguments.num_threads;
-	// Determine how many chunks should be along the x and y axis
-	// while keeping the chunks as square as possible
-	int a = sqrt(thread_count);
-	int b;
-	while(a != 1)
-	{
-		b = thread_count / a;
-		if(a * b == thread_count)
-			break;
-		--a;
-	}
-	int vertical_chunks, horizontal_chunks;
-	// I wonder if this will help with caching? IDK
-	if(image_height > image_width)
-	{
-		vertical_chunks = b;
-		horizontal_chunks = a;
-	}
-	else
-	{
-		vertical_chunks = a;
-		horizontal_chunks = b;
-	}
-	int num_chunks = vertical_chunks * horizontal_chunks;
-	int chunk_height = image_height / vertical_chunks;
-	int extra_height = image_height % vertical_chunks;
-	int chunk_width = image_width / horizontal_chunks;
-	int extra_width = image_width % horizontal_chunks;
+		double time0 = frame;
+		double time1 = frame + 1;
+		if (frame > 0)
+		{
+			// Only the boxes of the moving objects change from frame to frame, so refit the ones
+			// above them instead of building a new tree -- until it has drifted too far from a
+			// good tree. A scene where nothing moves costs nothing here.
+			t.start();
+			scoped_phase refit_phase("bvh refit", frame);
+			bvh->refit_objects(time0, time1, moving);
+			bool rebuild = bvh->needs_rebuild();
+			if (rebuild)
+				bvh = build_bvh(world, time0, time1, arguments.bvh, arguments.bvh_width, arguments.num_threads);
+			refit_phase.end();
+			t.stop();
+			std::cerr << "Frame " << frame << ": " << (rebuild ? "rebuilt" : "refit") <<
+						 " the bounding volume hierarchy in " << t.duration_ms() << " milliseconds (" <<
+						 moving.size() << " moving objects).\n";
 
-	if (arguments.verbose != 0)
-	{
-		std::cerr << "DEBUG CHUNK INFO\n";
-		std::cerr << "# THREADS=" << thread_count << "\n";
-		std::cerr << "H_CHUNKS=" << horizontal_chunks << " // V_CHUNKS=" << vertical_chunks << " // TOTAL=" << num_chunks << "\n";
-		std::cerr << "CHUNK DIMENSIONS=" << chunk_width << "px X " << chunk_height << "px\n";
-		std::cerr << "EXTRA HORIZONTAL PIXELS=" << extra_width << " // EXTRA VERTICAL PIXELS=" << extra_height << "\n";
-		std::cerr << "PIXELS PER CHUNK=" << chunk_width * chunk_height << "\n";
-		std::cerr << "TOTAL PIXELS IN CHUNKS=" << (chunk_width * chunk_height) * num_chunks << "\n";
-		std::cerr << "PIXELS IN IMAGE=" << image_height * image_width << "\n";
-	}
+			cam = camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, time0, time1);
+		}
+		// Frames before a checkpoint are already saved. Their bvh refits still have to happen,
+		// so the later frames get the same tree.
+		if (frame < first_frame)
+			continue;
 
-	int h = chunk_height;
-	int w = chunk_width;
-	//for(int j = image_height - 1; j >= 0; j = j - h)
-	int j = image_height - 1;
-	while(j >= 0)
-	{
-		h = (j < image_height - 1) ? chunk_height : chunk_height + extra_height;
-		//for(int i = 0; i < image_width; i = i + w)
-		int i = 0;
-		while(i < image_width)
+		// Open the image first, there is no point rendering a frame that can't be saved.
+		std::ofstream file;
+		std::string filename;
+		if (arguments.output_file)
 		{
-			w = (i > 0) ? chunk_width : chunk_width + extra_width;
-			// Make a future for each chunk
-			auto future = std::async(std::launch::async,// | std::launch::deferred,
-			[&cam, &bvh, &lights, &background, &max_depth, &samples_per_pixel,
-			i, j, w, h, image_width, image_height, &pixels_cv]() -> 
-			std::vector<pixel_data> {
-						std::vector<pixel_data> chunk_pixels;
-						for(int dj = 0; dj < h; ++dj)
-						{
-							int y = j - dj;
-							for (int di = 0; di < w; ++di)
-							{
-								int x = i + di;
-								unsigned int index = (y * image_width) + x;
-								color pixel_color(0, 0, 0);
-								for (int s = 0; s < samples_per_pixel; ++s)
-								{
-									auto u = double(x + random_double()) / (image_width - 1);
-									auto v = double(y + random_double()) / (image_height - 1);
-									ray r = cam.get_ray(u, v);
-									pixel_color += ray_color(r, background, bvh, lights, max_depth);
-								}
-								pixel_data pixel = {};
-								pixel.col = normalize(pixel_color, samples_per_pixel);
-								pixel.index = index;
-								chunk_pixels.push_back(pixel);
-							}
-						}
-						return chunk_pixels;
-				}
-			);
+			filename = frame_filename(arguments.output_file, frame, arguments.frames);
+			file.open(filename, std::ios::binary);
+			if (!file)
 			{
-				std::lock_guard<std::mutex> lock(mutex);
-				pixel_futures.push_back(std::move(future));
+				std::cerr << "ERROR: could not write the image to '" << filename << "'.\n";
+				return 1;
 			}
-			i += w;
 		}
-		j -= h;
-	}
 
-	// Wait until each chunk has been created
-	{
-		std::unique_lock<std::mutex> lock(mutex);
-		pixels_cv.wait(lock, [&pixel_futures, &num_chunks] { 
-							return pixel_futures.size() >= num_chunks;
-		});
+		sampler_settings sampling = { arguments.sampler, arguments.rng, hash_combine(arguments.seed, frame), samples_per_pixel };
+		double render_ms = 0;
+		// Every pass but the last, saving a checkpoint now and then. The ones before a
+		// checkpoint in the middle of this frame are already in fb.
+		for (int pass = 0; pass < passes - 1; ++pass)
+		{
+			int first = pass * samples_per_pixel / passes;
+			int last = (pass + 1) * samples_per_pixel / passes;
+			if (frame == first_frame && last <= resume_samples)
+				continue;
+			fb.start_frame();
+			render_ms += render(cam, *bvh, *lights, background, fb, first, last - first, limits,
+			                    sampling, arguments.num_threads, arguments.tile_size, arguments.verbose != 0);
+			std::cerr << "Pass " << pass + 1 << " of " << passes << " done, " << last << " samples per pixel.\n";
+			std::chrono::duration<double> since = std::chrono::steady_clock::now() - last_checkpoint;
+			if (arguments.checkpoint_file && since.count() >= arguments.checkpoint_every)
+				save_checkpoint(frame, last);
+		}
+
+		// The last pass is written a band at a time while it renders.
+		const int first = (passes - 1) * samples_per_pixel / passes;
+		fb.start_frame();
+		auto encoder = make_image_encoder(arguments.output_file ? file : std::cout,
+		                                  arguments.output_file ? arguments.output_format : image_format::ppm_text,
+		                                  arguments.exr_float != 0);
+		tile_writer writer(*encoder, fb);
+
+		render_ms += render(cam, *bvh, *lights, background, fb, first, samples_per_pixel - first, limits,
+		                    sampling, arguments.num_threads, arguments.tile_size, arguments.verbose != 0);
+
+		std::cerr << "Writing...\n";
+		t.start();
+		{
+			scoped_phase output_phase("output", frame);
+			writer.finish();
+		}
+		t.stop();
+		if (arguments.output_file && !file.flush())
+		{
+			std::cerr << "ERROR: could not write the image to '" << filename << "'.\n";
+			return 1;
+		}
+		if (arguments.verbose)
+			std::cerr << "Writing the image took " << writer.busy_ms << " milliseconds, " << t.duration_ms() <<
+						 " of them after the render.\n";
+		// Only once the image is saved can a resumed run skip this frame -- a failed write
+		// has returned above.
+		if (arguments.checkpoint_file)
+			save_checkpoint(frame + 1, 0);
+
+		if (arguments.stats)
+		{
+			ray_counters counts = render_stats().take();
+			print_ray_stats(std::cerr, counts, render_ms);
+			if (stats_json.is_open())
+			{
+				stats_json << (frame > 0 ? ",\n" : "");
+				write_ray_stats_json(stats_json, counts, render_ms);
+			}
+		}
 	}
+	if (stats_json.is_open())
+		stats_json << "\n]\n";
 
-	// Get each pixel from the vector of futures and order them
-	for(std::future<std::vector<pixel_data>>& ch : pixel_futures)
+	if (arguments.trace_file)
 	{
-		std::vector<pixel_data> chunk = ch.get();
-		for(pixel_data& pd : chunk)
+		if (arguments.verbose)
 		{
-			pixels[pd.index] = pd.col;
+			std::cerr << "Time spent in each phase:\n";
+			run_profiler().report();
 		}
+		if (!run_profiler().write_chrome_trace(arguments.trace_file))
+			std::cerr << "ERROR: could not write the trace to '" << arguments.trace_file << "'.\n";
 	}
-#endif
-
-	std::cerr << "Writing...";
-	for(int j = image_height - 1; j >= 0; --j)
-		for(int i = 0; i < image_width; ++i)
-			write_color(std::cout, (color)(pixels[(j * image_width) + i]), samples_per_pixel);
-	free(pixels);
-	std::cerr << "\nDONE.\n";
+	std::cerr << "DONE.\n";
 }
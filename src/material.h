@@ -11,8 +11,12 @@ struct hit_record;
 struct scatter_record {
 	ray specular_ray;
 	bool is_specular;
+	bool is_volume = false; // a specular_ray scattered inside a volume, counted against --max-volume
 	color attenuation;
-	shared_ptr<pdf> pdf_ptr;
+	// The pdf the next direction is picked with when is_specular is false. Kept by value so
+	// scattering never allocates. Every material that uses one is cosine weighted so far;
+	// a material that needs another kind would turn this into a std::variant.
+	cosine_pdf pdf;
 };
 
 class material {
@@ -42,7 +46,7 @@ class lambertian : public material {
 			) const override {
 			srec.is_specular = false;
 			srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-			srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+			srec.pdf = cosine_pdf(rec.normal);
 			return true;
 		}
 
@@ -68,7 +72,6 @@ class metal : public material {
 			srec.specular_ray = ray(rec.p, reflected + fuzz * random_in_unit_sphere()), r_in.time();
 			srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
 			srec.is_specular = true;
-			srec.pdf_ptr = nullptr;
 			return true;
 		}
 
@@ -94,7 +97,6 @@ class dialectric : public material {
 				const ray& r_in, const hit_record& rec, scatter_record& srec
 			) const override {
 			srec.is_specular = true;
-			srec.pdf_ptr = nullptr;
 			srec.attenuation = color(1.0, 1.0, 1.0); // Always 1 since glass absorbs no light.
 
 			double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
@@ -178,21 +180,24 @@ class diffuse_light_dim_edges : public material {
 		shared_ptr<texture> emit;
 		double width;
 };
+#endif
 
+// The phase function of constant_medium. The new direction is picked without a pdf,
+// like a mirror, so it goes out as a specular_ray.
 class isotropic : public material {
 	public:
 		isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
 		isotropic(shared_ptr<texture> a) : albedo(a) {}
 
-		virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-			const override {
-				scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-				attenuation = albedo->value(rec.u, rec.v, rec.p);
-				return true;
-			}
+		virtual bool scatter(const ray& r_in, const hit_record& rec, scatter_record& srec) const override {
+			srec.specular_ray = ray(rec.p, random_unit_vector(), r_in.time());
+			srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+			srec.is_specular = true;
+			srec.is_volume = true;
+			return true;
+		}
 
 	public:
 		shared_ptr<texture> albedo;
 };
 #endif
-#endif
@@ -0,0 +1,61 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using std::shared_ptr;
+
+class material;
+
+// Index of a material in the material table. Geometry stores this instead of a shared_ptr,
+// so hitting something never touches the material's reference count.
+using material_id = uint32_t;
+
+// Id 0 is "no material", for objects like the ones in the lights list that are only aimed at.
+const material_id no_material = 0;
+
+/*
+ Owns every material in the scene. Geometry constructors still take a shared_ptr<material>
+ and add it here, so the scene functions don't have to know about the table. Adding the
+ same material twice gives back the same id.
+
+ Materials are only added while the scene is built. Render threads only call get(), which
+ doesn't lock.
+*/
+class material_table {
+	public:
+		material_table() : materials(1) {}
+
+		material_id add(const shared_ptr<material>& m) {
+			if (!m)
+				return no_material;
+			std::lock_guard<std::mutex> lock(mutex);
+			auto found = ids.find(m.get());
+			if (found != ids.end())
+				return found->second;
+			material_id id = static_cast<material_id>(materials.size());
+			materials.push_back(m);
+			ids.emplace(m.get(), id);
+			return id;
+		}
+
+		const material* get(material_id id) const {
+			return materials[id].get();
+		}
+
+	private:
+		std::vector<shared_ptr<material>> materials;
+		std::unordered_map<const material*, material_id> ids;
+		std::mutex mutex;
+};
+
+inline material_table& scene_materials() {
+	static material_table table;
+	return table;
+}
+
+#endif
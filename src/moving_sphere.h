@@ -10,28 +10,43 @@ class moving_sphere : public hittable {
 		moving_sphere() {}
     moving_sphere(
         point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
-        : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
-    {};
+        : moving_sphere(cen0, cen1, _time0, _time1, r, scene_materials().add(m))
+    {}
+    moving_sphere(
+        point3 cen0, point3 cen1, double _time0, double _time1, double r, material_id m)
+        : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat(m)
+    {}
 
     virtual bool hit(
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void surface(const ray& r, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        double root;
+        return nearest_root(r, t_min, t_max, root);
+    }
     
     virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override;
+    virtual bool moves() const override { return true; }
 
     point3 center(double time) const;
 
+    private:
+        bool nearest_root(const ray& r, double t_min, double t_max, double& root) const;
+
     public:
         point3 center0, center1;
         double time0, time1;
         double radius;
-        shared_ptr<material> mat_ptr;
+        material_id mat;
 };
 
 point3 moving_sphere::center(double time) const {
     return center0 + ((time - time0) / (time1 - time0))*(center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool moving_sphere::nearest_root(const ray& r, double t_min, double t_max, double& root) const {
+    COUNT_STAT(primitive_tests[stat_moving_sphere], 1);
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -42,20 +57,30 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || t_max < root) {
         root = (-half_b + sqrtd) / a;
         if (root < t_min || t_max < root)
             return false;
     }
+    return true;
+}
+
+bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double root;
+    if (!nearest_root(r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
+    rec.object = this;
+    return true;
+}
+
+void moving_sphere::surface(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
-
-    return true;
+    rec.mat_ptr = scene_materials().get(mat);
 }
 
 bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const {
@@ -18,13 +18,13 @@ inline vec3 random_to_sphere(double radius, double distance_squared)
 }
 
 
-class pdf {
-	public:
-		virtual ~pdf() {}
+/*
+ The pdfs are small value types with no common base class, so a bounce can build them on
+ the stack instead of allocating them with make_shared. Each one has
 
-		virtual double value(const vec3& direction) const = 0;
-		virtual vec3 generate() const = 0;
-};
+   double value(const vec3& direction) const;  -- the pdf of direction
+   vec3 generate() const;                      -- a direction picked with that pdf
+*/
 
 inline vec3 random_cosine_direction() {
 	auto r1 = random_double();
@@ -38,16 +38,17 @@ inline vec3 random_cosine_direction() {
 	return vec3(x, y, z);
 }
 
-class cosine_pdf : public pdf {
+class cosine_pdf {
 	public:
+		cosine_pdf() {}
 		cosine_pdf(const vec3& w) { uvw.build_from_w(w); }
 
-		virtual double value(const vec3& direction) const override {
+		double value(const vec3& direction) const {
 			auto cosine = dot(unit_vector(direction), uvw.w());
 			return (cosine <= 0) ? 0 : cosine/pi;
 		}
 
-		virtual vec3 generate() const override {
+		vec3 generate() const {
 			return uvw.local(random_cosine_direction());
 		}
 
@@ -55,43 +56,44 @@ class cosine_pdf : public pdf {
 		onb uvw;
 };
 
-class hittable_pdf : public pdf {
+// Points at the object from origin. Doesn't own the object, so it must outlive the pdf.
+class hittable_pdf {
 	public:
-		hittable_pdf(shared_ptr<hittable> p, const point3& origin) : ptr(p), o(origin) {}
+		hittable_pdf(const hittable& p, const point3& origin) : ptr(&p), o(origin) {}
 
-		virtual double value(const vec3& direction) const override {
+		double value(const vec3& direction) const {
 			return ptr->pdf_value(o, direction);
 		}
 
-		virtual vec3 generate() const override {
+		vec3 generate() const {
 			return ptr->random(o);
 		}
 
 	public:
+		const hittable* ptr;
 		point3 o;
-		shared_ptr<hittable> ptr;
 };
 
-class mixture_pdf : public pdf {
+// Half of each.
+template <typename pdf0, typename pdf1>
+class mixture_pdf {
 	public:
-		mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
-			p[0] = p0;
-			p[1] = p1;
-		}
+		mixture_pdf(const pdf0& p0, const pdf1& p1) : p0(p0), p1(p1) {}
 
-		virtual double value(const vec3& direction) const override {
-			return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
+		double value(const vec3& direction) const {
+			return 0.5 * p0.value(direction) + 0.5 * p1.value(direction);
 		}
 
-		virtual vec3 generate() const override {
+		vec3 generate() const {
 			if(random_double() < 0.5)
-				return p[0]->generate();
+				return p0.generate();
 			else
-				return p[1]->generate();
+				return p1.generate();
 		}
 
 	public:
-		shared_ptr<pdf> p[2];
+		pdf0 p0;
+		pdf1 p1;
 };
 
 #endif
@@ -5,8 +5,12 @@
 #include "moving_sphere.h"
 #include "aarect.h"
 #include "box.h"
-//#include "constant_medium.h"
-hittable_list lambertian_cornell_box() {
+#include "triangle.h"
+#include "linear_bvh.h"
+#include "instance.h"
+#include "constant_medium.h"
+// lights gets the objects worth aiming rays at: the ceiling light and the glass sphere.
+hittable_list lambertian_cornell_box(hittable_list& lights) {
     hittable_list objects;
 
     auto red   = make_shared<lambertian>(color(.65, .05, .05));
@@ -36,5 +40,129 @@ hittable_list lambertian_cornell_box() {
 	auto glass = make_shared<dialectric>(1.5);
 	objects.add(make_shared<sphere>(point3(190, 90, 190), 90, glass));
 
+	// The glass sphere doesn't give off light, so it has no material here and shadow rays skip it.
+	lights.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+	lights.add(make_shared<sphere>(point3(190, 90, 190), 90, shared_ptr<material>()));
+
+	return objects;
+}
+
+// The cornell box with two boxes of smoke in it, to try the volume paths on.
+hittable_list cornell_smoke(hittable_list& lights) {
+    hittable_list objects;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light)));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+    box1 = make_shared<rotate_y>(box1, 15);
+    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+
+    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+    box2 = make_shared<rotate_y>(box2, -18);
+    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+
+    objects.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
+    objects.add(make_shared<constant_medium>(box2, 0.01, color(1, 1, 1)));
+
+    lights.add(make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light)));
+
+    return objects;
+}
+
+// A cone shaped tree made of triangles, standing on the origin.
+hittable_list tree_mesh(int sides) {
+	hittable_list tris;
+
+	auto bark   = make_shared<lambertian>(color(.35, .22, .1));
+	auto leaves = make_shared<lambertian>(color(.1, .4, .12));
+
+	auto ring = [sides](int i, double radius, double y) {
+		double a = 2 * pi * i / sides;
+		return point3(radius * cos(a), y, radius * sin(a));
+	};
+
+	for (int i = 0; i < sides; i++) {
+		// Trunk
+		point3 b0 = ring(i, 0.15, 0), b1 = ring(i + 1, 0.15, 0);
+		point3 t0 = ring(i, 0.12, 1), t1 = ring(i + 1, 0.12, 1);
+		tris.add(make_shared<triangle>(b0, t0, b1, false, bark));
+		tris.add(make_shared<triangle>(b1, t0, t1, false, bark));
+
+		// Three stacked cones of leaves
+		for (int level = 0; level < 3; level++) {
+			double y = 0.8 + 0.7 * level;
+			double radius = 1.0 - 0.25 * level;
+			point3 tip(0, y + 1.4, 0);
+			point3 c0 = ring(i, radius, y), c1 = ring(i + 1, radius, y);
+			tris.add(make_shared<triangle>(c0, tip, c1, false, leaves));
+			tris.add(make_shared<triangle>(c0, c1, point3(0, y, 0), false, leaves));
+		}
+	}
+
+	return tris;
+}
+
+// 10,000 copies of one tree. The tree's triangles are in one bvh that every instance
+// shares, and the world bvh is built over the instances.
+hittable_list instanced_forest() {
+	hittable_list objects;
+
+	auto ground = make_shared<lambertian>(color(.4, .5, .3));
+	objects.add(make_shared<xz_rect>(-200, 200, -200, 200, 0, ground));
+
+	auto tree = make_shared<linear_bvh>(tree_mesh(16), 0, 1);
+	for (int i = 0; i < 10000; i++) {
+		double s = random_double(0.7, 1.4);
+		point3 where(random_double(-100, 100), 0, random_double(-100, 100));
+		affine transform = affine::translation(where)
+		                 * affine::rotation_y(random_double(0, 360))
+		                 * affine::scale(vec3(s, s * random_double(0.8, 1.3), s));
+		objects.add(make_shared<instance>(tree, transform));
+	}
+
+	return objects;
+}
+
+// A smaller forest with balls drifting through it, for animations. Each ball keeps going
+// in a straight line from frame to frame while the trees stay put, so only the balls need
+// their boxes refit. Some of the balls are translated, which makes them instances.
+hittable_list drifting_balls() {
+	hittable_list objects;
+
+	auto ground = make_shared<lambertian>(color(.4, .5, .3));
+	objects.add(make_shared<xz_rect>(-200, 200, -200, 200, 0, ground));
+
+	auto tree = make_shared<linear_bvh>(tree_mesh(16), 0, 1);
+	for (int i = 0; i < 2000; i++) {
+		double s = random_double(0.7, 1.4);
+		point3 where(random_double(-60, 60), 0, random_double(-60, 60));
+		affine transform = affine::translation(where)
+		                 * affine::rotation_y(random_double(0, 360))
+		                 * affine::scale(vec3(s, s * random_double(0.8, 1.3), s));
+		objects.add(make_shared<instance>(tree, transform));
+	}
+
+	for (int i = 0; i < 300; i++) {
+		auto paint = make_shared<lambertian>(color(random_double(), random_double(), random_double()));
+		point3 start(random_double(-60, 60), random_double(1, 6), random_double(-60, 60));
+		vec3 velocity(random_double(-2, 2), random_double(-0.2, 0.2), random_double(-2, 2));
+		double radius = random_double(0.4, 1.2);
+		if (i % 4 == 0)
+			objects.add(make_shared<translate>(
+				make_shared<moving_sphere>(point3(0, 0, 0), velocity, 0, 1, radius, paint), start - point3(0, 0, 0)));
+		else
+			objects.add(make_shared<moving_sphere>(start, start + velocity, 0, 1, radius, paint));
+	}
+
 	return objects;
 }
@@ -0,0 +1,144 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ Wall clock timings of the phases of a run -- scene setup, bvh build, render, every tile,
+ output -- on every thread, so a slow job can be taken apart afterwards.
+
+ Each thread appends to its own list of events, so timing a tile never takes a lock. The
+ lists are only gathered when the trace is written. While the profiler is off a phase costs
+ a branch and nothing else.
+
+ write_chrome_trace() produces the JSON that chrome://tracing and Perfetto open, with one
+ row per thread.
+*/
+struct trace_event {
+	const char* name;
+	int64_t start_us, duration_us;
+	// Shown with the event, e.g. the tile index. -1 for none.
+	int64_t arg;
+};
+
+class profiler {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		profiler() : origin(clock::now()) {}
+
+		bool enabled() const { return on; }
+		// Call this from main, so the main thread is the first one in the trace.
+		void enable() {
+			on = true;
+			thread_events();
+		}
+
+		int64_t now_us() const {
+			return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - origin).count();
+		}
+
+		void record(const char* name, int64_t start_us, int64_t end_us, int64_t arg) {
+			thread_events().events.push_back({ name, start_us, end_us - start_us, arg });
+		}
+
+		bool write_chrome_trace(const std::string& filename) {
+			std::ofstream out(filename);
+			if (!out)
+				return false;
+			std::lock_guard<std::mutex> lock(mutex);
+			out << "{\"traceEvents\":[\n";
+			bool first = true;
+			for (const auto& thread : threads) {
+				out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << thread->id
+				    << ",\"args\":{\"name\":\"" << (thread->id == 0 ? "main" : "thread " + std::to_string(thread->id)) << "\"}}";
+				first = false;
+				for (const trace_event& e : thread->events) {
+					out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread->id
+					    << ",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us;
+					if (e.arg >= 0)
+						out << ",\"args\":{\"index\":" << e.arg << "}";
+					out << "}";
+				}
+			}
+			out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+			return static_cast<bool>(out);
+		}
+
+		// Total wall time of each phase, added up over every thread.
+		void report() {
+			std::map<std::string, std::pair<int64_t, int>> totals;
+			std::lock_guard<std::mutex> lock(mutex);
+			for (const auto& thread : threads)
+				for (const trace_event& e : thread->events) {
+					auto& total = totals[e.name];
+					total.first += e.duration_us;
+					total.second++;
+				}
+			for (const auto& phase : totals)
+				std::cerr << "  " << phase.first << ": " << phase.second.first / 1000.0 << " ms in "
+				          << phase.second.second << (phase.second.second == 1 ? " span\n" : " spans\n");
+		}
+
+	private:
+		struct thread_trace {
+			int id;
+			std::vector<trace_event> events;
+		};
+
+		thread_trace& thread_events() {
+			thread_local thread_trace* mine = nullptr;
+			if (!mine) {
+				std::lock_guard<std::mutex> lock(mutex);
+				threads.emplace_back(new thread_trace{ static_cast<int>(threads.size()), {} });
+				mine = threads.back().get();
+			}
+			return *mine;
+		}
+
+		clock::time_point origin;
+		bool on = false;
+		std::mutex mutex;
+		std::vector<std::unique_ptr<thread_trace>> threads;
+};
+
+inline profiler& run_profiler() {
+	static profiler p;
+	return p;
+}
+
+// Times from construction until end() or the end of the scope, whichever is first.
+class scoped_phase {
+	public:
+		explicit scoped_phase(const char* name, int64_t arg = -1)
+			: name(name), arg(arg), start_us(run_profiler().enabled() ? run_profiler().now_us() : -1) {}
+
+		~scoped_phase() {
+			end();
+		}
+
+		void end() {
+			if (start_us < 0)
+				return;
+			profiler& p = run_profiler();
+			p.record(name, start_us, p.now_us(), arg);
+			start_us = -1;
+		}
+
+	private:
+		const char* name;
+		int64_t arg;
+		int64_t start_us;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef RAY_STATS_H
+#define RAY_STATS_H
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ Counts of the work a render does -- rays of each kind, bvh nodes visited and primitives
+ tested -- to tell whether a slow scene is spending its time in traversal, in the
+ primitives or in shading.
+
+ Every thread counts into its own ray_counters, on its own cache line, and they are only
+ added up after a render. The counting is compiled in unless RT_STATS is defined to 0, and
+ then it only happens while --stats is on, so a normal render pays one predictable branch
+ per counter.
+*/
+#ifndef RT_STATS
+#define RT_STATS 1
+#endif
+
+enum stat_primitive { stat_sphere, stat_moving_sphere, stat_triangle, stat_rect, stat_medium, stat_instance, stat_primitive_kinds };
+
+inline const char* stat_primitive_name(int kind) {
+	static const char* names[stat_primitive_kinds] = { "sphere", "moving_sphere", "triangle", "rect", "medium", "instance" };
+	return names[kind];
+}
+
+struct alignas(64) ray_counters {
+	uint64_t camera_rays = 0;
+	uint64_t bounce_rays = 0;
+	uint64_t shadow_rays = 0;
+	uint64_t node_visits = 0;
+	uint64_t primitive_tests[stat_primitive_kinds] = {};
+
+	ray_counters& operator+=(const ray_counters& o) {
+		camera_rays += o.camera_rays;
+		bounce_rays += o.bounce_rays;
+		shadow_rays += o.shadow_rays;
+		node_visits += o.node_visits;
+		for (int i = 0; i < stat_primitive_kinds; ++i)
+			primitive_tests[i] += o.primitive_tests[i];
+		return *this;
+	}
+
+	uint64_t rays() const { return camera_rays + bounce_rays + shadow_rays; }
+};
+
+class ray_stats {
+	public:
+		bool enabled = false;
+
+		ray_counters& this_thread() {
+			thread_local ray_counters* mine = nullptr;
+			if (!mine) {
+				std::lock_guard<std::mutex> lock(mutex);
+				threads.emplace_back(new ray_counters());
+				mine = threads.back().get();
+			}
+			return *mine;
+		}
+
+		// Adds up every thread's counts and starts them all again from zero. Only call this
+		// while nothing is rendering.
+		ray_counters take() {
+			std::lock_guard<std::mutex> lock(mutex);
+			ray_counters total;
+			for (auto& thread : threads) {
+				total += *thread;
+				*thread = ray_counters();
+			}
+			return total;
+		}
+
+	private:
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ray_counters>> threads;
+};
+
+inline ray_stats& render_stats() {
+	static ray_stats stats;
+	return stats;
+}
+
+#if RT_STATS
+#define COUNT_STAT(field, n) do { if (render_stats().enabled) render_stats().this_thread().field += (n); } while (0)
+#else
+#define COUNT_STAT(field, n) do { (void)(n); } while (0)
+#endif
+
+inline void print_ray_stats(std::ostream& out, const ray_counters& c, double render_ms) {
+	auto per = [](uint64_t a, uint64_t b) { return b ? double(a) / b : 0.0; };
+	uint64_t traced = c.camera_rays + c.bounce_rays;
+	uint64_t tests = 0;
+	for (int i = 0; i < stat_primitive_kinds; ++i)
+		tests += c.primitive_tests[i];
+
+	out << "Rays: " << c.camera_rays << " camera, " << c.bounce_rays << " bounce, " << c.shadow_rays << " shadow -- "
+	    << per(c.rays(), 1000 * render_ms) << " Mrays/s\n";
+	out << "Average path length " << per(traced, c.camera_rays) << " rays, "
+	    << per(c.shadow_rays, c.camera_rays) << " shadow rays per path\n";
+	out << "Bvh nodes visited: " << c.node_visits << " (" << per(c.node_visits, c.rays()) << " per ray)\n";
+	out << "Primitive tests: " << tests << " (" << per(tests, c.rays()) << " per ray)";
+	for (int i = 0; i < stat_primitive_kinds; ++i)
+		if (c.primitive_tests[i])
+			out << ", " << c.primitive_tests[i] << " " << stat_primitive_name(i);
+	out << "\n";
+}
+
+// One JSON object, for one render.
+inline void write_ray_stats_json(std::ostream& out, const ray_counters& c, double render_ms) {
+	out << "{\"render_ms\":" << render_ms << ",\"camera_rays\":" << c.camera_rays << ",\"bounce_rays\":" << c.bounce_rays
+	    << ",\"shadow_rays\":" << c.shadow_rays << ",\"mrays_per_s\":" << (render_ms > 0 ? c.rays() / (1000 * render_ms) : 0)
+	    << ",\"node_visits\":" << c.node_visits << ",\"primitive_tests\":{";
+	for (int i = 0; i < stat_primitive_kinds; ++i)
+		out << (i ? "," : "") << "\"" << stat_primitive_name(i) << "\":" << c.primitive_tests[i];
+	out << "}}";
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+#include <cstring>
+
+/*
+ Random numbers for random_double().
+
+ rand() keeps one hidden state for the whole program behind a lock, so every render
+ thread fights over it and the image changes from run to run. Instead every thread
+ has its own generator (see pixel_sampler in sampler.h), which is one of two kinds:
+
+ sequential -- xoshiro256++, seeded once per render tile. The same seed and tile size
+               give the same image.
+ hashed     -- no state at all. Every number is a hash of (seed, pixel, sample, dimension),
+               where dimension counts the numbers used so far by the sample. The image does
+               not depend on the tiles or the order the pixels are rendered in.
+*/
+enum class rng_mode { sequential, hashed };
+
+inline bool parse_rng_mode(const char* name, rng_mode& mode) {
+	if (strcmp(name, "xoshiro") == 0)
+		mode = rng_mode::sequential;
+	else if (strcmp(name, "hash") == 0)
+		mode = rng_mode::hashed;
+	else
+		return false;
+	return true;
+}
+
+// The splitmix64 finalizer. Every bit of the input affects every bit of the output.
+inline uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+inline uint64_t hash_combine(uint64_t seed, uint64_t value) {
+	return mix64(seed + 0x9e3779b97f4a7c15ULL + value);
+}
+
+// The top 53 bits as a double in [0, 1).
+inline double to_unit_double(uint64_t x) {
+	return (x >> 11) * 0x1.0p-53;
+}
+
+// xoshiro256++ by Blackman and Vigna. 32 bytes of state and a handful of shifts and adds.
+class xoshiro256pp {
+	public:
+		xoshiro256pp(uint64_t seed = 0) { reseed(seed); }
+
+		// The four words come from splitmix64 so that similar seeds still give unrelated streams.
+		void reseed(uint64_t seed) {
+			for (int i = 0; i < 4; ++i) {
+				seed += 0x9e3779b97f4a7c15ULL;
+				s[i] = mix64(seed);
+			}
+		}
+
+		uint64_t next() {
+			uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+			uint64_t t = s[1] << 17;
+			s[2] ^= s[0];
+			s[3] ^= s[1];
+			s[1] ^= s[2];
+			s[0] ^= s[3];
+			s[2] ^= t;
+			s[3] = rotl(s[3], 45);
+			return result;
+		}
+
+	private:
+		static uint64_t rotl(uint64_t x, int k) {
+			return (x << k) | (x >> (64 - k));
+		}
+
+		uint64_t s[4];
+};
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "rng.h"
+
+/*
+ Where random_double() gets its numbers from while a pixel is being rendered.
+
+ Every call made by one camera sample is given the next dimension: the pixel jitter is
+ dimensions 0 and 1, the lens 2 and 3 (if there is an aperture), the ray time the next
+ one, and then each bounce takes what it needs. A sampler picks the value for
+ (pixel, sample, dimension) so that the samples of a pixel spread out evenly in each
+ dimension instead of clumping the way independent numbers do.
+
+ independent -- the thread's generator, xoshiro or hashed (see rng.h).
+ stratified  -- each dimension is cut into samples_per_pixel strata and every sample gets
+                its own, in a different random order per dimension (Latin hypercube).
+ sobol       -- Owen-scrambled Sobol points. Only the first four Sobol dimensions are used;
+                each group of four dimensions shuffles the sample order and scrambles with
+                its own seed (Burley, "Practical Hash-based Owen Scrambling", 2020).
+                Best with a power of two samples per pixel.
+ halton      -- the Halton sequence with a random shift per pixel and dimension. Falls back
+                to hashed numbers past the 64th dimension.
+ blue_noise  -- the same Sobol points in every pixel, shifted by a blue noise mask. The
+                error left over is blue noise across the image, which looks much
+                less noisy at low sample counts than white noise of the same size.
+
+ None of them keep any state, so they all give the same image for any thread count.
+*/
+enum class sampler_type { independent, stratified, sobol, halton, blue_noise };
+
+inline bool parse_sampler_type(const char* name, sampler_type& type) {
+	if (strcmp(name, "independent") == 0)
+		type = sampler_type::independent;
+	else if (strcmp(name, "stratified") == 0)
+		type = sampler_type::stratified;
+	else if (strcmp(name, "sobol") == 0)
+		type = sampler_type::sobol;
+	else if (strcmp(name, "halton") == 0)
+		type = sampler_type::halton;
+	else if (strcmp(name, "bluenoise") == 0)
+		type = sampler_type::blue_noise;
+	else
+		return false;
+	return true;
+}
+
+// How the render threads set up their samplers.
+struct sampler_settings {
+	sampler_type type;
+	rng_mode rng;
+	uint64_t seed;
+	int samples_per_pixel;
+};
+
+// A 32 bit integer as a fraction in [0, 1).
+inline double to_unit_double(uint32_t x) {
+	return x * 0x1.0p-32;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Position of i in a random permutation of [0, n) picked by seed. Kensler, "Correlated
+// Multi-Jittered Sampling", 2013. Shuffles within the next power of two and retries until
+// the result lands inside n.
+inline uint32_t permute(uint32_t i, uint32_t n, uint32_t seed) {
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= seed;
+		i *= 0xe170893du;
+		i ^= seed >> 16;
+		i ^= (i & w) >> 4;
+		i ^= seed >> 8;
+		i *= 0x0929eb3fu;
+		i ^= seed >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | seed >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= n);
+	return (i + seed) % n;
+}
+
+/*
+ Sobol sampling
+*/
+
+// Direction numbers for the first four Sobol dimensions. The first is the van der Corput
+// sequence, the others come from the primitive polynomials in Joe and Kuo's table.
+struct sobol_directions {
+	uint32_t v[4][32];
+
+	sobol_directions() {
+		for (int i = 0; i < 32; ++i)
+			v[0][i] = 1u << (31 - i);
+
+		// degree s, coefficients a and initial numbers m for dimensions 2 to 4
+		const int s[3] = { 1, 2, 3 };
+		const uint32_t a[3] = { 0, 1, 1 };
+		const uint32_t m[3][3] = { { 1 }, { 1, 3 }, { 1, 3, 1 } };
+		for (int d = 1; d < 4; ++d) {
+			int degree = s[d - 1];
+			for (int i = 0; i < 32; ++i) {
+				if (i < degree) {
+					v[d][i] = m[d - 1][i] << (31 - i);
+					continue;
+				}
+				v[d][i] = v[d][i - degree] ^ (v[d][i - degree] >> degree);
+				for (int k = 1; k < degree; ++k)
+					if ((a[d - 1] >> (degree - 1 - k)) & 1)
+						v[d][i] ^= v[d][i - k];
+			}
+		}
+	}
+};
+
+inline uint32_t sobol(uint32_t index, int dimension) {
+	static const sobol_directions directions;
+	uint32_t x = 0;
+	for (int bit = 0; index; ++bit, index >>= 1)
+		if (index & 1)
+			x ^= directions.v[dimension][bit];
+	return x;
+}
+
+// Laine and Karras' hash, which only lets lower bits affect higher ones. Run on the
+// reversed bits it becomes an Owen scramble: every bit is flipped based on the bits above it.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+// One dimension of the shuffled, scrambled Sobol point number index.
+inline double owen_sobol(uint32_t index, uint64_t dimension, uint64_t seed) {
+	uint32_t group_seed = static_cast<uint32_t>(hash_combine(seed, dimension / 4));
+	index = nested_uniform_scramble(index, group_seed);
+	int d = static_cast<int>(dimension % 4);
+	return to_unit_double(nested_uniform_scramble(sobol(index, d), static_cast<uint32_t>(hash_combine(group_seed, d))));
+}
+
+/*
+ Halton sampling
+*/
+
+const int halton_dimensions = 64;
+const uint32_t halton_primes[halton_dimensions] = {
+	  2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+	 59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+	137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+	227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+};
+
+inline double radical_inverse(uint32_t base, uint32_t index) {
+	double inv_base = 1.0 / base;
+	double inv_base_n = 1.0;
+	uint64_t reversed = 0;
+	while (index) {
+		uint32_t next = index / base;
+		reversed = reversed * base + (index - next * base);
+		inv_base_n *= inv_base;
+		index = next;
+	}
+	return fmin(reversed * inv_base_n, 1 - 0x1.0p-53);
+}
+
+/*
+ Blue noise mask
+*/
+
+// A tileable blue noise dither matrix made with Ulichney's void and cluster method.
+// Every value from 0 to size*size-1 appears once, and pixels with close values are far apart.
+class blue_noise_mask {
+	public:
+		static const int size = 64;
+
+		blue_noise_mask() {
+			const int n = size * size;
+			const double sigma = 1.9;
+
+			// Energy a point at (0, 0) adds to every pixel, wrapping around the edges.
+			std::vector<double> kernel(n);
+			for (int y = 0; y < size; ++y) {
+				for (int x = 0; x < size; ++x) {
+					int dx = x < size / 2 ? x : size - x;
+					int dy = y < size / 2 ? y : size - y;
+					kernel[y * size + x] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+				}
+			}
+
+			std::vector<char> on(n, 0);
+			std::vector<double> energy(n, 0.0);
+			auto toggle = [&](int p) {
+				double sign = on[p] ? -1.0 : 1.0;
+				on[p] = !on[p];
+				int px = p % size, py = p / size;
+				for (int y = 0; y < size; ++y) {
+					const double* row = &kernel[((y - py + size) % size) * size];
+					for (int x = 0; x < size; ++x)
+						energy[y * size + x] += sign * row[(x - px + size) % size];
+				}
+			};
+			// The tightest cluster is the point with the most energy, the largest void is
+			// the empty pixel with the least.
+			auto tightest_cluster = [&]() {
+				int best = -1;
+				for (int p = 0; p < n; ++p)
+					if (on[p] && (best < 0 || energy[p] > energy[best]))
+						best = p;
+				return best;
+			};
+			auto largest_void = [&]() {
+				int best = -1;
+				for (int p = 0; p < n; ++p)
+					if (!on[p] && (best < 0 || energy[p] < energy[best]))
+						best = p;
+				return best;
+			};
+
+			// Start from a tenth of the pixels at random, then move points out of clusters
+			// into voids until the one that moves would go straight back.
+			xoshiro256pp generator(n);
+			int initial = n / 10;
+			for (int placed = 0; placed < initial;) {
+				int p = static_cast<int>(generator.next() % n);
+				if (!on[p]) {
+					toggle(p);
+					++placed;
+				}
+			}
+			for (int i = 0; i < n; ++i) {
+				int cluster = tightest_cluster();
+				toggle(cluster);
+				int hole = largest_void();
+				toggle(hole);
+				if (hole == cluster)
+					break;
+			}
+			std::vector<char> start = on;
+			std::vector<double> start_energy = energy;
+
+			// The initial points are ranked by taking away the tightest cluster each time...
+			rank.assign(n, 0);
+			for (int count = initial; count > 0; --count) {
+				int cluster = tightest_cluster();
+				toggle(cluster);
+				rank[cluster] = count - 1;
+			}
+
+			// ...and the rest by filling in the largest void each time.
+			on = start;
+			energy = start_energy;
+			for (int count = initial; count < n; ++count) {
+				int hole = largest_void();
+				toggle(hole);
+				rank[hole] = count;
+			}
+		}
+
+		// The mask value at (x, y) in [0, 1), centered in its slot.
+		double value(uint32_t x, uint32_t y) const {
+			return (rank[(y % size) * size + (x % size)] + 0.5) / (size * size);
+		}
+
+	private:
+		std::vector<int> rank;
+};
+
+/*
+ The per thread sampler random_double() draws from.
+*/
+class pixel_sampler {
+	public:
+		double next_double() {
+			uint64_t d = dimension++;
+			switch (settings.type) {
+			case sampler_type::independent:
+				if (settings.rng == rng_mode::hashed)
+					return to_unit_double(hash_combine(pixel_key, d));
+				return to_unit_double(generator.next());
+			case sampler_type::stratified: {
+				uint32_t n = static_cast<uint32_t>(settings.samples_per_pixel);
+				// The order of the strata is the same for every sample of the pixel, so each
+				// sample gets its own one. Where it lands inside it differs from sample to sample.
+				uint64_t h = hash_combine(pixel_key, d);
+				uint32_t stratum = permute(sample % n, n, static_cast<uint32_t>(h));
+				uint64_t jitter = hash_combine(h, sample);
+				return (stratum + to_unit_double(static_cast<uint32_t>(jitter >> 32))) / n;
+			}
+			case sampler_type::sobol:
+				return owen_sobol(sample, d, pixel_key);
+			case sampler_type::halton: {
+				if (d >= halton_dimensions)
+					return to_unit_double(hash_combine(pixel_key, d));
+				double shifted = radical_inverse(halton_primes[d], sample) + to_unit_double(hash_combine(pixel_key, d));
+				return shifted < 1 ? shifted : shifted - 1;
+			}
+			case sampler_type::blue_noise: {
+				// The same points everywhere, so the shift is all that differs between pixels.
+				// Each dimension looks at a different part of the mask.
+				static const blue_noise_mask mask;
+				uint64_t offset = hash_combine(settings.seed, d);
+				double shifted = owen_sobol(sample, d, settings.seed)
+				               + mask.value(x + static_cast<uint32_t>(offset), y + static_cast<uint32_t>(offset >> 32));
+				return shifted < 1 ? shifted : shifted - 1;
+			}
+			}
+			return 0;
+		}
+
+		// Called by a render thread before it starts on a tile of the image.
+		void start_tile(const sampler_settings& s, uint64_t tile) {
+			settings = s;
+			if (settings.samples_per_pixel < 1)
+				settings.samples_per_pixel = 1;
+			generator.reseed(hash_combine(s.seed, tile));
+		}
+
+		// Called before each camera sample.
+		void start_sample(uint32_t px, uint32_t py, uint64_t pixel, uint32_t s) {
+			x = px;
+			y = py;
+			sample = s;
+			dimension = 0;
+			pixel_key = hash_combine(settings.seed, pixel);
+			if (settings.type == sampler_type::independent)
+				pixel_key = hash_combine(pixel_key, s);
+		}
+
+		sampler_settings settings = { sampler_type::independent, rng_mode::sequential, 0, 1 };
+		uint32_t x = 0, y = 0;
+		uint32_t sample = 0;
+		uint64_t dimension = 0;
+		uint64_t pixel_key = 0;
+		xoshiro256pp generator;
+};
+
+// The sampler of the calling thread. Threads that never call start_tile() (scene setup,
+// bvh builds) get the independent xoshiro generator with seed 0, so scenes come out the
+// same every run.
+inline pixel_sampler& this_thread_sampler() {
+	thread_local pixel_sampler sampler;
+	return sampler;
+}
+
+#endif
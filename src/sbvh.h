@@ -0,0 +1,394 @@
+#ifndef SBVH_H
+#define SBVH_H
+
+#include "common.h"
+#include "hittable.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+ Spatial split BVH (SBVH) construction, from Stich, Friedrich and Dietrich,
+ "Spatial Splits in Bounding Volume Hierarchies" (2009).
+
+ An object split has to put every object entirely on one side, so long thin triangles
+ that lie across each other give two children whose boxes mostly overlap, and a ray
+ that goes through the overlap has to visit both. A spatial split cuts the node with
+ a plane instead and puts an object that crosses the plane on both sides, each copy
+ (a "reference") with only the bounds of the part of the object on that side
+ (see hittable::split_bounds).
+
+ Every node tries the usual binned SAH object split. If its children overlap by a
+ noticeable amount, it also tries binned spatial splits and keeps whichever is cheaper.
+ Duplicated references take memory and can make a ray test the same object twice,
+ so there is a budget on how many extra references the whole tree can have, and
+ the traversal skips objects it has already tested (see mailbox in linear_bvh.h).
+
+ The build is sequential. It is meant for static meshes that are built once.
+*/
+
+// Only look for spatial splits when the children of the best object split overlap
+// by more than this fraction of the surface area of the whole scene.
+const double sbvh_min_overlap = 1e-5;
+
+// At most this many extra references per object in the whole tree.
+const double sbvh_duplication_budget = 1.0;
+
+const int sbvh_spatial_bins = 16;
+
+struct sbvh_reference {
+    aabb box;
+    uint32_t object;
+};
+
+// A node of the finished tree, in the same depth first layout as linear_bvh_node.
+// Leaves hold references[first, first + count).
+struct sbvh_node {
+    aabb box;
+    uint32_t second_child;
+    uint32_t first;
+    uint32_t count;
+    int axis;
+};
+
+inline bool box_is_empty(const aabb& box) {
+    return box.min().x() > box.max().x() || box.min().y() > box.max().y() || box.min().z() > box.max().z();
+}
+
+inline aabb box_overlap(const aabb& a, const aabb& b) {
+    point3 lo, hi;
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = std::max(a.min()[i], b.min()[i]);
+        hi[i] = std::min(a.max()[i], b.max()[i]);
+    }
+    return aabb(lo, hi);
+}
+
+class sbvh_builder {
+    public:
+        sbvh_builder(const std::vector<shared_ptr<hittable>>& objects, const std::vector<bvh_primitive>& prims);
+
+    public:
+        std::vector<sbvh_node> nodes;
+        std::vector<uint32_t> references; // The object behind each leaf slot
+
+    private:
+        struct object_split {
+            double cost = infinity;
+            int axis = -1;
+            int bin = -1;
+            double lo, scale;
+            aabb left, right;
+        };
+
+        struct spatial_split {
+            double cost = infinity;
+            int axis = -1;
+            double position;
+        };
+
+        void build(std::vector<sbvh_reference>& refs, int depth);
+        object_split find_object_split(const std::vector<sbvh_reference>& refs, const aabb& bounds) const;
+        spatial_split find_spatial_split(const std::vector<sbvh_reference>& refs, const aabb& bounds) const;
+        void split_reference(const sbvh_reference& ref, int axis, double position, sbvh_reference& left, sbvh_reference& right) const;
+        void make_leaf(const std::vector<sbvh_reference>& refs, uint32_t index);
+
+    private:
+        const std::vector<shared_ptr<hittable>>& objects;
+        double root_area;
+        size_t budget;
+};
+
+sbvh_builder::sbvh_builder(const std::vector<shared_ptr<hittable>>& objects, const std::vector<bvh_primitive>& prims)
+    : objects(objects) {
+    std::vector<sbvh_reference> refs(prims.size());
+    aabb bounds = aabb::empty();
+    for (size_t i = 0; i < prims.size(); ++i) {
+        refs[i].box = prims[i].box;
+        refs[i].object = i;
+        bounds = surrounding_box(bounds, prims[i].box);
+    }
+
+    root_area = bounds.surface_area();
+    budget = static_cast<size_t>(prims.size() * sbvh_duplication_budget);
+    nodes.reserve(2 * prims.size());
+    references.reserve(prims.size() + budget);
+    if (!refs.empty())
+        build(refs, 0);
+}
+
+void sbvh_builder::split_reference(const sbvh_reference& ref, int axis, double position,
+                                   sbvh_reference& left, sbvh_reference& right) const {
+    objects[ref.object]->split_bounds(ref.box, axis, position, left.box, right.box);
+    left.object = right.object = ref.object;
+}
+
+void sbvh_builder::make_leaf(const std::vector<sbvh_reference>& refs, uint32_t index) {
+    nodes[index].first = references.size();
+    nodes[index].count = refs.size();
+    for (const sbvh_reference& ref : refs)
+        references.push_back(ref.object);
+}
+
+// The same binned SAH as sah_split in bvh.h, on the references' centroids.
+sbvh_builder::object_split sbvh_builder::find_object_split(const std::vector<sbvh_reference>& refs, const aabb& bounds) const {
+    aabb centroid_bounds = aabb::empty();
+    for (const sbvh_reference& ref : refs)
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(ref.box.centroid(), ref.box.centroid()));
+
+    object_split best;
+    for (int a = 0; a < 3; ++a) {
+        double lo = centroid_bounds.min()[a];
+        double extent = centroid_bounds.max()[a] - lo;
+        if (extent <= 0)
+            continue;
+        double scale = sah_bins / extent;
+
+        aabb boxes[sah_bins];
+        int counts[sah_bins] = {};
+        for (int b = 0; b < sah_bins; ++b)
+            boxes[b] = aabb::empty();
+        for (const sbvh_reference& ref : refs) {
+            int b = std::min(static_cast<int>((ref.box.centroid()[a] - lo) * scale), sah_bins - 1);
+            counts[b]++;
+            boxes[b] = surrounding_box(boxes[b], ref.box);
+        }
+
+        aabb right_boxes[sah_bins - 1];
+        int right_counts[sah_bins - 1];
+        aabb right_box = aabb::empty();
+        int count = 0;
+        for (int b = sah_bins - 1; b > 0; --b) {
+            right_box = surrounding_box(right_box, boxes[b]);
+            count += counts[b];
+            right_boxes[b - 1] = right_box;
+            right_counts[b - 1] = count;
+        }
+
+        aabb left_box = aabb::empty();
+        count = 0;
+        for (int b = 0; b < sah_bins - 1; ++b) {
+            left_box = surrounding_box(left_box, boxes[b]);
+            count += counts[b];
+            if (count == 0 || right_counts[b] == 0)
+                continue;
+            double cost = sah_traversal_cost
+                        + (count * left_box.surface_area() + right_counts[b] * right_boxes[b].surface_area()) / bounds.surface_area();
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = a;
+                best.bin = b;
+                best.lo = lo;
+                best.scale = scale;
+                best.left = left_box;
+                best.right = right_boxes[b];
+            }
+        }
+    }
+    return best;
+}
+
+// Cuts the node into equal slabs on each axis. Every reference is clipped into each slab
+// it crosses, and only counted where it starts and where it ends, so the plane after
+// slab b has everything that starts at or before b on the left and everything that ends
+// after b on the right.
+sbvh_builder::spatial_split sbvh_builder::find_spatial_split(const std::vector<sbvh_reference>& refs, const aabb& bounds) const {
+    spatial_split best;
+    for (int a = 0; a < 3; ++a) {
+        double lo = bounds.min()[a];
+        double extent = bounds.max()[a] - lo;
+        if (extent <= 0)
+            continue;
+        double width = extent / sbvh_spatial_bins;
+        auto bin_of = [lo, width](double x) {
+            return std::max(0, std::min(static_cast<int>((x - lo) / width), sbvh_spatial_bins - 1));
+        };
+
+        aabb boxes[sbvh_spatial_bins];
+        int entries[sbvh_spatial_bins] = {};
+        int exits[sbvh_spatial_bins] = {};
+        for (int b = 0; b < sbvh_spatial_bins; ++b)
+            boxes[b] = aabb::empty();
+
+        for (const sbvh_reference& ref : refs) {
+            int first = bin_of(ref.box.min()[a]);
+            int last = bin_of(ref.box.max()[a]);
+            entries[first]++;
+            exits[last]++;
+
+            sbvh_reference rest = ref;
+            for (int b = first; b < last; ++b) {
+                sbvh_reference left, right;
+                split_reference(rest, a, lo + (b + 1) * width, left, right);
+                if (!box_is_empty(left.box))
+                    boxes[b] = surrounding_box(boxes[b], left.box);
+                rest = right;
+                if (box_is_empty(rest.box))
+                    break;
+            }
+            if (!box_is_empty(rest.box))
+                boxes[last] = surrounding_box(boxes[last], rest.box);
+        }
+
+        aabb right_boxes[sbvh_spatial_bins - 1];
+        int right_counts[sbvh_spatial_bins - 1];
+        aabb right_box = aabb::empty();
+        int count = 0;
+        for (int b = sbvh_spatial_bins - 1; b > 0; --b) {
+            right_box = surrounding_box(right_box, boxes[b]);
+            count += exits[b];
+            right_boxes[b - 1] = right_box;
+            right_counts[b - 1] = count;
+        }
+
+        aabb left_box = aabb::empty();
+        count = 0;
+        for (int b = 0; b < sbvh_spatial_bins - 1; ++b) {
+            left_box = surrounding_box(left_box, boxes[b]);
+            count += entries[b];
+            if (count == 0 || right_counts[b] == 0)
+                continue;
+            double cost = sah_traversal_cost
+                        + (count * left_box.surface_area() + right_counts[b] * right_boxes[b].surface_area()) / bounds.surface_area();
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = a;
+                best.position = lo + (b + 1) * width;
+            }
+        }
+    }
+    return best;
+}
+
+void sbvh_builder::build(std::vector<sbvh_reference>& refs, int depth) {
+    aabb bounds = aabb::empty();
+    for (const sbvh_reference& ref : refs)
+        bounds = surrounding_box(bounds, ref.box);
+
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    nodes[index].box = bounds;
+
+    const size_t n = refs.size();
+    if (n == 1) {
+        make_leaf(refs, index);
+        return;
+    }
+
+    std::vector<sbvh_reference> left, right;
+    int axis = 0;
+
+    if (depth >= bvh_max_depth / 2) {
+        // Same as the other builders -- past half the stack depth, median splits make sure the rest fits.
+        aabb centroid_bounds = aabb::empty();
+        for (const sbvh_reference& ref : refs)
+            centroid_bounds = surrounding_box(centroid_bounds, aabb(ref.box.centroid(), ref.box.centroid()));
+        vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+        axis = (extent.x() > extent.y()) ? 0 : 1;
+        if (extent.z() > extent[axis]) axis = 2;
+        std::nth_element(refs.begin(), refs.begin() + n / 2, refs.end(),
+            [axis](const sbvh_reference& a, const sbvh_reference& b) {
+                return a.box.centroid()[axis] < b.box.centroid()[axis];
+            });
+        left.assign(refs.begin(), refs.begin() + n / 2);
+        right.assign(refs.begin() + n / 2, refs.end());
+    } else {
+        object_split object = find_object_split(refs, bounds);
+        spatial_split spatial;
+        if (budget > 0 && (object.axis == -1
+            || box_overlap(object.left, object.right).surface_area() / root_area > sbvh_min_overlap))
+            spatial = find_spatial_split(refs, bounds);
+
+        double best_cost = std::min(object.cost, spatial.cost);
+        if (n <= sah_max_leaf_size && best_cost >= n) {
+            make_leaf(refs, index);
+            return;
+        }
+
+        if (spatial.cost < object.cost) {
+            axis = spatial.axis;
+            const double position = spatial.position;
+
+            // Everything that doesn't cross the plane goes to its side as it is.
+            aabb left_box = aabb::empty(), right_box = aabb::empty();
+            std::vector<sbvh_reference> straddling;
+            for (const sbvh_reference& ref : refs) {
+                if (ref.box.max()[axis] <= position) {
+                    left.push_back(ref);
+                    left_box = surrounding_box(left_box, ref.box);
+                } else if (ref.box.min()[axis] >= position) {
+                    right.push_back(ref);
+                    right_box = surrounding_box(right_box, ref.box);
+                } else {
+                    straddling.push_back(ref);
+                }
+            }
+
+            // Each object across the plane is split, unless putting all of it on one side
+            // is cheaper ("reference unsplitting" in the paper) or the budget has run out.
+            double left_count = left.size() + straddling.size();
+            double right_count = right.size() + straddling.size();
+            for (const sbvh_reference& ref : straddling) {
+                sbvh_reference l, r;
+                split_reference(ref, axis, position, l, r);
+                aabb split_left = box_is_empty(l.box) ? left_box : surrounding_box(left_box, l.box);
+                aabb split_right = box_is_empty(r.box) ? right_box : surrounding_box(right_box, r.box);
+                aabb all_left = surrounding_box(left_box, ref.box);
+                aabb all_right = surrounding_box(right_box, ref.box);
+
+                double split_cost = split_left.surface_area() * left_count + split_right.surface_area() * right_count;
+                double left_cost = all_left.surface_area() * left_count + right_box.surface_area() * (right_count - 1);
+                double right_cost = left_box.surface_area() * (left_count - 1) + all_right.surface_area() * right_count;
+
+                bool split = budget > 0 && !box_is_empty(l.box) && !box_is_empty(r.box)
+                          && split_cost < left_cost && split_cost < right_cost;
+                if (split) {
+                    --budget;
+                    left.push_back(l);
+                    right.push_back(r);
+                    left_box = split_left;
+                    right_box = split_right;
+                } else if (left_cost <= right_cost) {
+                    left.push_back(ref);
+                    left_box = all_left;
+                    --right_count;
+                } else {
+                    right.push_back(ref);
+                    right_box = all_right;
+                    --left_count;
+                }
+            }
+        }
+
+        if (left.empty() || right.empty()) {
+            // Either the object split won, or the spatial split ended up with everything on one side.
+            left.clear();
+            right.clear();
+            if (object.axis == -1) {
+                // Every centroid is in the same place, so split the list down the middle.
+                left.assign(refs.begin(), refs.begin() + n / 2);
+                right.assign(refs.begin() + n / 2, refs.end());
+                axis = 0;
+            } else {
+                axis = object.axis;
+                for (const sbvh_reference& ref : refs) {
+                    int b = std::min(static_cast<int>((ref.box.centroid()[axis] - object.lo) * object.scale), sah_bins - 1);
+                    (b <= object.bin ? left : right).push_back(ref);
+                }
+            }
+        }
+    }
+
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+
+    // The references are copied into the children, so free them before going deeper.
+    std::vector<sbvh_reference>().swap(refs);
+    build(left, depth + 1);
+    nodes[index].second_child = nodes.size();
+    build(right, depth + 1);
+}
+
+#endif
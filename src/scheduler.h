@@ -0,0 +1,169 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "thread_pool.h"
+
+// A rectangle of the image, [x0, x1) x [y0, y1). index is its place in reading order
+// from the top left, which does not depend on the number of threads.
+struct tile {
+	int x0, y0, x1, y1;
+	uint64_t index;
+};
+
+// A part of the image to render instead of all of it, in pixels, counting rows from the
+// top: [x0, x1) x [y0, y1).
+struct image_region {
+	int x0, y0, x1, y1;
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+	bool contains(int x, int row) const { return x >= x0 && x < x1 && row >= y0 && row < y1; }
+};
+
+// The tiles waiting for one worker. The owner takes from the front and thieves take from
+// the back, so they only meet when there is one tile left. alignas keeps the locks of
+// neighbouring workers on separate cache lines.
+struct alignas(64) tile_queue {
+	std::mutex mutex;
+	std::deque<tile> tiles;
+
+	bool pop_front(tile& t) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (tiles.empty())
+			return false;
+		t = tiles.front();
+		tiles.pop_front();
+		return true;
+	}
+
+	bool steal_back(tile& t) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (tiles.empty())
+			return false;
+		t = tiles.back();
+		tiles.pop_back();
+		return true;
+	}
+};
+
+// What one worker did during a render.
+struct worker_stats {
+	double busy_ms = 0;
+	int tiles = 0;
+	int stolen = 0;
+};
+
+/*
+ Cuts the image into small square tiles and hands them out to the workers.
+
+ Splitting the image into one big chunk per thread means the render takes as long as
+ the slowest chunk -- the one with the glass sphere in it -- while the threads that got
+ plain walls sit idle. With many small tiles and stealing, a worker that runs out takes
+ tiles from the end of someone else's queue, so every thread stays busy until the
+ last few tiles.
+
+ Each worker starts with runs of neighbouring tiles, so the parts of the scene it touches
+ stay in its cache until it has to steal. The runs are dealt out a row of tiles at a time,
+ so all the workers move down the image together and the top of the image is finished
+ first -- the writer thread can save it while the rest is still rendering.
+
+ For a crop only the tiles that overlap it are rendered, but they are the same tiles as in
+ the whole image, with the same index, so they get the same random numbers.
+*/
+class tile_scheduler {
+	public:
+		tile_scheduler(int image_width, int image_height, int tile_size, int num_workers, const image_region& region)
+			: queues(num_workers) {
+			const uint64_t image_tiles_per_row = (image_width + tile_size - 1) / tile_size;
+			std::vector<tile> all;
+			for (int y = region.y0 / tile_size * tile_size; y < region.y1; y += tile_size)
+				for (int x = region.x0 / tile_size * tile_size; x < region.x1; x += tile_size)
+					all.push_back({ x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height),
+					                uint64_t(y / tile_size) * image_tiles_per_row + x / tile_size });
+			num_tiles = static_cast<int>(all.size());
+			const size_t tiles_per_row = (region.x1 - 1) / tile_size - region.x0 / tile_size + 1;
+			const size_t run = std::max<size_t>(1, tiles_per_row / num_workers);
+			for (size_t first = 0; first < all.size(); first += run) {
+				size_t last = std::min(first + run, all.size());
+				std::deque<tile>& queue = queues[(first / run) % num_workers].tiles;
+				queue.insert(queue.end(), all.begin() + first, all.begin() + last);
+			}
+		}
+
+		// The next tile for worker, from its own queue or stolen from another.
+		// Returns false once every tile has been handed out.
+		bool next(int worker, tile& t, bool& stolen) {
+			stolen = false;
+			if (queues[worker].pop_front(t))
+				return true;
+			int n = static_cast<int>(queues.size());
+			for (int i = 1; i < n; ++i) {
+				if (queues[(worker + i) % n].steal_back(t)) {
+					stolen = true;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Runs render_tile(worker, tile) for every tile on num_workers threads of the worker
+		// pool and returns what each thread did.
+		template <typename F>
+		std::vector<worker_stats> run(F render_tile) {
+			int n = static_cast<int>(queues.size());
+			std::vector<worker_stats> stats(n);
+			auto work = [this, &stats, &render_tile](int worker) {
+				tile t;
+				bool stolen;
+				while (next(worker, t, stolen)) {
+					auto start = std::chrono::steady_clock::now();
+					render_tile(worker, t);
+					auto end = std::chrono::steady_clock::now();
+					stats[worker].busy_ms += std::chrono::duration<double, std::milli>(end - start).count();
+					stats[worker].tiles++;
+					stats[worker].stolen += stolen;
+				}
+			};
+
+			task_group group;
+			for (int w = 1; w < n; ++w)
+				group.run([&work, w]() { work(w); });
+			work(0);
+			group.wait();
+			return stats;
+		}
+
+	public:
+		int num_tiles;
+
+	private:
+		std::vector<tile_queue> queues;
+};
+
+// How much of the render each thread spent rendering tiles instead of waiting.
+inline void report_utilization(const std::vector<worker_stats>& stats, double wall_ms, int num_tiles, bool verbose) {
+	double total = 0;
+	double lowest = 1;
+	int stolen = 0;
+	for (size_t w = 0; w < stats.size(); ++w) {
+		double utilization = wall_ms > 0 ? stats[w].busy_ms / wall_ms : 1;
+		total += utilization;
+		lowest = std::min(lowest, utilization);
+		stolen += stats[w].stolen;
+		if (verbose)
+			std::cerr << "Thread " << w << ": " << stats[w].tiles << " tiles (" << stats[w].stolen << " stolen), busy "
+			          << 100 * utilization << "% of " << wall_ms << " ms\n";
+	}
+	std::cerr << "Rendered " << num_tiles << " tiles, " << stolen << " stolen. Threads were busy "
+	          << 100 * total / stats.size() << "% of the time on average, " << 100 * lowest << "% at the lowest.\n";
+}
+
+#endif
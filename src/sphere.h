@@ -8,14 +8,22 @@
 class sphere : public hittable {
 	public:
 		sphere() {}
-		sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {};
+		sphere(point3 cen, double r, shared_ptr<material> m) : sphere(cen, r, scene_materials().add(m)) {}
+		sphere(point3 cen, double r, material_id m) : center(cen), radius(r), mat(m) {}
 
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual void surface(const ray& r, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			double root;
+			return nearest_root(r, t_min, t_max, root);
+		}
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 		virtual double pdf_value(const point3& origin, const vec3& v) const override;
 		virtual vec3 random(const point3& o) const override;
 
 	private:
+		bool nearest_root(const ray& r, double t_min, double t_max, double& root) const;
+
 		static void get_sphere_uv(const point3& p, double& u, double& v) {
 			auto theta = acos(-p.y());
 			auto phi = atan2(-p.z(), p.x()) + pi;
@@ -27,10 +35,12 @@ class sphere : public hittable {
 	public:
 		point3 center;
 		double radius;
-		shared_ptr<material> mat_ptr;
+		material_id mat;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// The closest t in [t_min, t_max] where the ray is on the sphere.
+bool sphere::nearest_root(const ray& r, double t_min, double t_max, double& root) const {
+	COUNT_STAT(primitive_tests[stat_sphere], 1);
 	vec3 oc = r.origin() - center;
 	auto a = r.direction().length_squared();
 	auto half_b = dot(oc, r.direction());
@@ -41,22 +51,32 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
 	if (discriminant < 0) return false;
 	auto sqrtd = sqrt(discriminant);
 
-	auto root = (-half_b - sqrtd) / a;
+	root = (-half_b - sqrtd) / a;
 	if (root < t_min || t_max < root)
 	{
 	  root = (-half_b + sqrtd) / a;
 	  if (root < t_min || t_max < root)
 		  return false;
   }
+	return true;
+}
+
+bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	double root;
+	if (!nearest_root(r, t_min, t_max, root))
+		return false;
 
 	rec.t = root;
+	rec.object = this;
+	return true;
+}
+
+void sphere::surface(const ray& r, hit_record& rec) const {
 	rec.p = r.at(rec.t);
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.mat_ptr = mat_ptr;
-
-	return true;
+	rec.mat_ptr = scene_materials().get(mat);
 }
 
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
@@ -65,8 +85,7 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 double sphere::pdf_value(const point3& origin, const vec3& v) const {
-	hit_record rec;
-	if(!this->hit(ray(origin, v), 0.001, infinity, rec))
+	if(!this->occluded(ray(origin, v), 0.001, infinity))
 		return 0;
 
 	auto cos_theta_max = sqrt(1 - radius * radius / (center - origin).length_squared());
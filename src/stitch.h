@@ -0,0 +1,76 @@
+#ifndef STITCH_H
+#define STITCH_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/*
+ Puts an image back together from parts that were rendered on their own with --crop or
+ --tile, by separate runs or on separate machines.
+
+ The parts are framebuffer files rather than finished images. A framebuffer file knows the
+ size of the whole image and where in it its own region goes, and it holds the linear
+ radiance, so nothing is lost to quantizing before the whole image is written.
+*/
+
+// The whole image from the framebuffer files in parts, stored like any other framebuffer.
+// Returns null, after saying why, if the parts don't belong together.
+inline std::unique_ptr<framebuffer> stitch_framebuffers(const std::vector<const char*>& parts, bool single_precision,
+                                                        const char* filename) {
+	std::vector<std::unique_ptr<framebuffer>> pieces;
+	for (const char* part : parts) {
+		pieces.push_back(framebuffer::open(part));
+		if (!pieces.back()) {
+			std::cerr << "ERROR: '" << part << "' can't be read as a framebuffer file.\n";
+			return nullptr;
+		}
+		const framebuffer& piece = *pieces.back();
+		const framebuffer& first = *pieces.front();
+		if (piece.image_width != first.image_width || piece.image_height != first.image_height) {
+			std::cerr << "ERROR: '" << part << "' is part of a " << piece.image_width << "x" << piece.image_height <<
+			             " image, '" << parts.front() << "' of a " << first.image_width << "x" << first.image_height << " one.\n";
+			return nullptr;
+		}
+	}
+	if (pieces.empty()) {
+		std::cerr << "ERROR: nothing to stitch.\n";
+		return nullptr;
+	}
+
+	const int width = pieces.front()->image_width;
+	const int height = pieces.front()->image_height;
+	std::unique_ptr<framebuffer> whole(new framebuffer(width, height, pieces.front()->tile_size, single_precision, filename));
+	// The columns each part covers, row by row.
+	std::vector<std::vector<std::pair<int, int>>> spans(height);
+	for (const auto& piece : pieces) {
+		std::vector<color> row(piece->width);
+		for (int y = 0; y < piece->height; ++y) {
+			piece->load_row(y, row.data());
+			for (int x = 0; x < piece->width; ++x)
+				whole->store(piece->x0 + x, piece->y0 + y, row[x]);
+			spans[piece->y0 + y].emplace_back(piece->x0, piece->x0 + piece->width);
+		}
+	}
+
+	// Overlapping parts are fine, the later one wins. Gaps are most likely a missing file.
+	uint64_t covered = 0;
+	for (auto& row : spans) {
+		std::sort(row.begin(), row.end());
+		int end = 0;
+		for (const auto& span : row) {
+			covered += std::max(0, span.second - std::max(span.first, end));
+			end = std::max(end, span.second);
+		}
+	}
+	if (covered < uint64_t(width) * height)
+		std::cerr << "WARNING: the parts cover " << covered << " of the " << uint64_t(width) * height <<
+		             " pixels, the rest are black.\n";
+	return whole;
+}
+
+#endif
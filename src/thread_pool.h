@@ -0,0 +1,179 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ One set of worker threads for the whole process.
+
+ Every bvh build, refit and render used to start its own threads with std::async or
+ std::thread and throw them away afterwards. For a long animation that is thousands of
+ threads, each one starting with a cold cache and a fresh stack to fault in. The pool is
+ started once in main and everything hands it work through a task_group.
+
+ The thread that waits on a task_group runs queued tasks itself until its own are done.
+ That is what lets the bvh builds split recursively -- a task can start more tasks and wait
+ for them without ever blocking a worker that something else is waiting on. It also means
+ a pool with no workers still works, everything just runs on the calling thread.
+*/
+class thread_pool {
+	public:
+		thread_pool() {}
+
+		~thread_pool() {
+			stop();
+		}
+
+		// Starts workers until there are num_workers of them. The thread that calls main is not
+		// counted, so for N threads of rendering start N - 1. With pin, worker i stays on cpu i + 1
+		// and the calling thread on cpu 0.
+		void start(int num_workers, bool pin = false) {
+			pinned = pin;
+			if (pin)
+				pin_to_cpu(0);
+			while (static_cast<int>(workers.size()) < num_workers) {
+				int cpu = static_cast<int>(workers.size()) + 1;
+				workers.emplace_back([this, cpu]() {
+					if (pinned)
+						pin_to_cpu(cpu);
+					work();
+				});
+			}
+		}
+
+		void stop() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (auto& worker : workers)
+				worker.join();
+			workers.clear();
+			stopping = false;
+		}
+
+		int size() const { return static_cast<int>(workers.size()); }
+
+		void push(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				tasks.push_back(std::move(task));
+			}
+			wake.notify_one();
+		}
+
+		// Runs one queued task on this thread. Returns false if there was nothing to run.
+		bool run_one() {
+			std::function<void()> task;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (tasks.empty())
+					return false;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+			return true;
+		}
+
+	private:
+		void work() {
+			for (;;) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+					if (tasks.empty())
+						return;
+					task = std::move(tasks.front());
+					tasks.pop_front();
+				}
+				task();
+			}
+		}
+
+		static void pin_to_cpu(int cpu) {
+#ifdef __linux__
+			int cpus = std::thread::hardware_concurrency();
+			if (cpus < 1)
+				return;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu % cpus, &set);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+				std::cerr << "Could not pin a thread to cpu " << cpu % cpus << ".\n";
+#endif
+		}
+
+		std::vector<std::thread> workers;
+		std::deque<std::function<void()>> tasks;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+		bool pinned = false;
+};
+
+inline thread_pool& worker_pool() {
+	static thread_pool pool;
+	return pool;
+}
+
+// A batch of tasks on the worker pool that can be waited on together.
+class task_group {
+	public:
+		task_group(thread_pool& pool = worker_pool()) : pool(pool) {}
+
+		// Never leave tasks running that point into a stack frame that is gone.
+		~task_group() {
+			wait();
+		}
+
+		template <typename F>
+		void run(F f) {
+			pending.fetch_add(1, std::memory_order_relaxed);
+			pool.push([this, f]() mutable {
+				f();
+				std::lock_guard<std::mutex> lock(mutex);
+				if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					done.notify_all();
+			});
+		}
+
+		// Helps out with queued tasks (this group's or anyone's) until every task in the group has finished.
+		void wait() {
+			while (pending.load(std::memory_order_acquire) > 0) {
+				if (pool.run_one())
+					continue;
+				// Everything left is already running on other threads.
+				std::unique_lock<std::mutex> lock(mutex);
+				done.wait_for(lock, std::chrono::milliseconds(1), [this]() {
+					return pending.load(std::memory_order_acquire) == 0;
+				});
+			}
+			// The last task may still be holding the lock after it counted down. Take it once
+			// so the group is not destroyed under it.
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+
+	private:
+		thread_pool& pool;
+		std::atomic<int> pending{0};
+		std::mutex mutex;
+		std::condition_variable done;
+};
+
+#endif
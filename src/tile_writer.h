@@ -0,0 +1,66 @@
+#ifndef TILE_WRITER_H
+#define TILE_WRITER_H
+
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "profiler.h"
+
+#include <chrono>
+#include <thread>
+
+/*
+ Saves the image while it is still rendering.
+
+ A thread of its own waits for each row of tiles to be finished and hands those rows to the
+ encoder, top to bottom, so the quantizing, compressing and writing happen alongside the
+ render instead of after it. The workers go down the image together (see tile_scheduler),
+ so by the time the last tiles are done, only the bottom band is left to write.
+
+ It is its own thread rather than a task on the worker pool because it spends most of its
+ time waiting, and a pool thread that waits can't render.
+*/
+class tile_writer {
+	public:
+		tile_writer(image_encoder& encoder, const framebuffer& fb)
+			: thread([this, &encoder, &fb]() { write_all(encoder, fb); }) {}
+
+		~tile_writer() {
+			finish();
+		}
+
+		// Waits for the last band to be written.
+		void finish() {
+			if (thread.joinable())
+				thread.join();
+		}
+
+	public:
+		// Filled in by the writer thread, read after finish().
+		double busy_ms = 0;
+
+	private:
+		void write_all(image_encoder& encoder, const framebuffer& fb) {
+			const uint64_t tiles_per_row = fb.tiles_per_row;
+			encoder.begin(fb.width, fb.height);
+			for (int band = 0; band < fb.tile_rows; ++band) {
+				fb.wait_for_tiles(band * tiles_per_row, (band + 1) * tiles_per_row);
+
+				scoped_phase phase("write band", band);
+				auto start = std::chrono::steady_clock::now();
+				int y0, y1;
+				fb.band_rows(band, y0, y1);
+				encoder.rows(fb, y0, y1);
+				encoder.flush();
+				fb.release_band(band);
+				busy_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+			auto start = std::chrono::steady_clock::now();
+			encoder.end();
+			encoder.flush();
+			busy_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		std::thread thread;
+};
+
+#endif
@@ -1,20 +1,23 @@
 #ifndef TIMER_H
 #define TIMER_H
 
-#include <time.h>
+#include <chrono>
 
+// NOTE :: this used to use clock(), but that is CPU time added up over every thread.
+//         Once the bvh build and the render are multithreaded that is not how long anything
+//         actually took, so this measures wall clock time instead.
 class timer {
     public: 
     timer(){}
 
-    void start(){ t0 = clock(); }
-    void stop() { t1 = clock(); }
+    void start(){ t0 = std::chrono::steady_clock::now(); }
+    void stop() { t1 = std::chrono::steady_clock::now(); }
 
-    double duration_s() { return (double)(t1 - t0) / CLOCKS_PER_SEC; }
-    double duration_ms() { return (t1 - t0) / (CLOCKS_PER_SEC / 1000.0); }
+    double duration_s() { return std::chrono::duration<double>(t1 - t0).count(); }
+    double duration_ms() { return std::chrono::duration<double, std::milli>(t1 - t0).count(); }
 
     public:
-    clock_t t0, t1;
+    std::chrono::steady_clock::time_point t0, t1;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -15,9 +15,19 @@ class triangle : public hittable {
 	public:
 		triangle() {}
 		triangle(const point3& _a, const point3& _b, const point3& _c, bool ss, shared_ptr<material> mat)
-		: v0(_a), v1(_b), v2(_c), single_sided(ss), mp(mat) {}
+		: triangle(_a, _b, _c, ss, scene_materials().add(mat)) {}
+		triangle(const point3& _a, const point3& _b, const point3& _c, bool ss, material_id mat)
+		: mp(mat), v0(_a), v1(_b), v2(_c), single_sided(ss) {}
 
 		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual void surface(const ray& r, hit_record& rec) const override;
+#if MT_ALG
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+			COUNT_STAT(primitive_tests[stat_triangle], 1);
+			double t, u, v;
+			return moller_trumbore(r, t_min, t_max, t, u, v);
+		}
+#endif
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 			// NOTE : the epsilon here is really only in the case where the triangle is aligned on an
 			//        axis. And I'm not sure it's actually necessary.
@@ -34,16 +44,21 @@ class triangle : public hittable {
 			return true;
 		}
 
+		virtual void split_bounds(const aabb& box, int axis, double position, aabb& left, aabb& right) const override;
+
+	private:
+		bool moller_trumbore(const ray& r, double t_min, double t_max, double& t, double& u, double& v) const;
+
 	public:
-		shared_ptr<material> mp;
+		material_id mp;
 		point3 v0;
 		point3 v1;
 		point3 v2;
 		bool single_sided;
 };
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-#if MT_ALG
+// The ray's t and the barycentric coordinates of the hit, if there is one in [t_min, t_max].
+bool triangle::moller_trumbore(const ray& r, double t_min, double t_max, double& t, double& u, double& v) const {
 	vec3 v01 = v1 - v0;
 	vec3 v02 = v2 - v0;
 
@@ -61,26 +76,30 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	double inv_det = 1.0 / det;
 
 	vec3 T = r.origin() - v0;                 // 'tvec' in source code
-	double u = dot(T, D_x_v02) * inv_det;
+	u = dot(T, D_x_v02) * inv_det;
 	if (u < 0.0 || u > 1.0)
 		return false;
 
 	vec3 T_x_v01 = cross(T, v01);             // 'qvec' in source code
-	double v = dot(r.direction(), T_x_v01) * inv_det;
+	v = dot(r.direction(), T_x_v01) * inv_det;
 	if (v < 0.0 || u + v > 1.0)
 		return false;
 
-	double t = dot(v02, T_x_v01) * inv_det;
+	t = dot(v02, T_x_v01) * inv_det;
+	return t >= t_min && t <= t_max;
+}
+
+bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	COUNT_STAT(primitive_tests[stat_triangle], 1);
+#if MT_ALG
+	double t, u, v;
+	if (!moller_trumbore(r, t_min, t_max, t, u, v))
+		return false;
 
 	rec.u = u;
 	rec.v = v;
 	rec.t = t;
-	rec.p = r.at(t);
-
-	rec.mat_ptr = mp;
-	// NOTE : is there a better way to get the normal from all of this?
-	//        it's late and I'm tired so I'll look into it tomorrow.
-	rec.set_face_normal(r, cross(v01, v02));
+	rec.object = this;
 	return true;
 #else
 	vec3 v01 = v1 - v0;
@@ -96,8 +115,8 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	double D = dot(n, v0);
 	double t = -(dot(n, r.origin()) + D) / n_dot_r;
 
-	// Check if triangle is behind
-	if (t < 0.0)
+	// Check if triangle is behind, or farther than something that was already hit
+	if (t < t_min || t > t_max)
 		return false;
 
 	vec3 p = r.at(t);
@@ -119,18 +138,75 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	if( (dot(n, c0) < 0) || (u < 0) || (v < 0) )
 		return false;
 
-	rec.set_face_normal(r, n);
-	if ((!rec.front_face) && single_sided)
+	// Back facing, same test as set_face_normal.
+	if (n_dot_r >= 0 && single_sided)
 		return false;
 
 	rec.t = t;
-	rec.p = p;
-	rec.mat_ptr = mp;
 	rec.u = u / denom;
 	rec.v = v / denom;
+	rec.object = this;
 
 	return true;
 #endif
 }
 
+void triangle::surface(const ray& r, hit_record& rec) const {
+	rec.p = r.at(rec.t);
+	rec.mat_ptr = scene_materials().get(mp);
+	// NOTE : is there a better way to get the normal from all of this?
+	//        it's late and I'm tired so I'll look into it tomorrow.
+	rec.set_face_normal(r, cross(v1 - v0, v2 - v0));
+}
+
+// Clips the triangle against the plane: every vertex goes to its own side, and every edge that
+// crosses the plane adds the crossing point to both sides. A long diagonal triangle only
+// covers a corner of each half of its box, so this is much tighter than cutting the box.
+void triangle::split_bounds(const aabb& box, int axis, double position, aabb& left, aabb& right) const {
+	const point3* v[3] = { &v0, &v1, &v2 };
+	point3 left_min(infinity, infinity, infinity), left_max(-infinity, -infinity, -infinity);
+	point3 right_min = left_min, right_max = left_max;
+
+	auto add = [](point3& lo, point3& hi, const point3& p) {
+		for (int a = 0; a < 3; a++) {
+			lo[a] = fmin(lo[a], p[a]);
+			hi[a] = fmax(hi[a], p[a]);
+		}
+	};
+
+	for (int i = 0; i < 3; i++) {
+		const point3& p = *v[i];
+		const point3& q = *v[(i + 1) % 3];
+		if (p[axis] <= position)
+			add(left_min, left_max, p);
+		if (p[axis] >= position)
+			add(right_min, right_max, p);
+		if ((p[axis] < position && q[axis] > position) || (p[axis] > position && q[axis] < position)) {
+			point3 crossing = p + (q - p) * ((position - p[axis]) / (q[axis] - p[axis]));
+			crossing[axis] = position;
+			add(left_min, left_max, crossing);
+			add(right_min, right_max, crossing);
+		}
+	}
+
+	// Pad like bounding_box does, then keep only the part inside box. box may already
+	// have been cut down by earlier splits.
+	vec3 epsilon = vec3(0.0001, 0.0001, 0.0001);
+	auto clip = [&box, &epsilon](const point3& lo, const point3& hi, bool keep_low, int axis, double position) {
+		point3 clipped_min = lo - epsilon;
+		point3 clipped_max = hi + epsilon;
+		for (int a = 0; a < 3; a++) {
+			clipped_min[a] = fmax(clipped_min[a], box.min()[a]);
+			clipped_max[a] = fmin(clipped_max[a], box.max()[a]);
+		}
+		if (keep_low)
+			clipped_max[axis] = fmin(clipped_max[axis], position);
+		else
+			clipped_min[axis] = fmax(clipped_min[axis], position);
+		return aabb(clipped_min, clipped_max);
+	};
+	left = clip(left_min, left_max, true, axis, position);
+	right = clip(right_min, right_max, false, axis, position);
+}
+
 #endif
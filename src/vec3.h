@@ -131,12 +131,12 @@ vec3 random_in_unit_sphere() {
   }
 }
 
+// Always uses exactly two random numbers (no rejection loop), so the samplers in
+// sampler.h can give the lens its own two dimensions.
 vec3 random_in_unit_disk() {
-	while (true) {
-		auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-		if (p.length_squared() >= 1) continue;
-		return p;
-	}
+	auto r = sqrt(random_double());
+	auto phi = 2 * pi * random_double();
+	return vec3(r * cos(phi), r * sin(phi), 0);
 }
 
 vec3 random_unit_vector() {
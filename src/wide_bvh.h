@@ -0,0 +1,551 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "common.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ A BVH with N children per node (N = 4 or 8) so one node visit tests N boxes at once.
+
+ It is made by collapsing a binary linear_bvh: starting with the two children of a
+ binary node, the child with the biggest surface area is replaced by its own two children
+ until there are N of them (or only leaves are left).
+
+ The child boxes are stored structure-of-arrays in floats, which is exactly the layout
+ an SSE (4 floats) or AVX (8 floats) register wants. Unused slots get an inside-out box
+ so they always miss.
+*/
+template <int N>
+struct alignas(32) wide_bvh_node {
+	float min_x[N], min_y[N], min_z[N];
+	float max_x[N], max_y[N], max_z[N];
+	uint32_t offset[N]; // Child node index, or first primitive if this child is a leaf
+	uint32_t count[N];  // Number of primitives in a leaf child, 0 for interior children
+};
+
+// The parts of the ray the slab test needs, converted to float once per ray.
+struct wide_ray {
+	wide_ray(const ray& r) {
+		for (int a = 0; a < 3; ++a) {
+			origin[a] = static_cast<float>(r.origin()[a]);
+			inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+			dir_is_neg[a] = inv_dir[a] < 0;
+		}
+	}
+
+	float origin[3];
+	float inv_dir[3];
+	bool dir_is_neg[3];
+};
+
+// The float slab test is slightly less accurate than the double one, so the far
+// distance is padded a little rather than miss boxes the ray only grazes.
+const float wide_t_max_pad = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+// Slab test against all N children of a node. Returns a bitmask of the children that
+// were hit and writes the entry distance of each child to t_near.
+//
+// NOTE :: the test picks the near and far planes by the sign of the direction instead of
+//         using min/max, and puts the new value first in each max/min so a NaN from
+//         0 * inf is ignored instead of making the box miss.
+template <int N>
+inline int intersect_children(const wide_bvh_node<N>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+	const float* near_planes[3] = {
+		wr.dir_is_neg[0] ? node.max_x : node.min_x,
+		wr.dir_is_neg[1] ? node.max_y : node.min_y,
+		wr.dir_is_neg[2] ? node.max_z : node.min_z };
+	const float* far_planes[3] = {
+		wr.dir_is_neg[0] ? node.min_x : node.max_x,
+		wr.dir_is_neg[1] ? node.min_y : node.max_y,
+		wr.dir_is_neg[2] ? node.min_z : node.max_z };
+
+	int mask = 0;
+	for (int i = 0; i < N; ++i) {
+		float t0 = t_min;
+		float t1 = t_max;
+		for (int a = 0; a < 3; ++a) {
+			float n = (near_planes[a][i] - wr.origin[a]) * wr.inv_dir[a];
+			float f = (far_planes[a][i] - wr.origin[a]) * wr.inv_dir[a];
+			t0 = n > t0 ? n : t0;
+			t1 = f < t1 ? f : t1;
+		}
+		t_near[i] = t0;
+		if (t0 <= t1)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+#if defined(__SSE2__)
+template <>
+inline int intersect_children<4>(const wide_bvh_node<4>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+	const float* near_planes[3] = {
+		wr.dir_is_neg[0] ? node.max_x : node.min_x,
+		wr.dir_is_neg[1] ? node.max_y : node.min_y,
+		wr.dir_is_neg[2] ? node.max_z : node.min_z };
+	const float* far_planes[3] = {
+		wr.dir_is_neg[0] ? node.min_x : node.max_x,
+		wr.dir_is_neg[1] ? node.min_y : node.max_y,
+		wr.dir_is_neg[2] ? node.min_z : node.max_z };
+
+	__m128 t0 = _mm_set1_ps(t_min);
+	__m128 t1 = _mm_set1_ps(t_max);
+	for (int a = 0; a < 3; ++a) {
+		__m128 o = _mm_set1_ps(wr.origin[a]);
+		__m128 inv = _mm_set1_ps(wr.inv_dir[a]);
+		__m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_planes[a]), o), inv);
+		__m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_planes[a]), o), inv);
+		t0 = _mm_max_ps(n, t0);
+		t1 = _mm_min_ps(f, t1);
+	}
+	_mm_storeu_ps(t_near, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int intersect_children<8>(const wide_bvh_node<8>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+	const float* near_planes[3] = {
+		wr.dir_is_neg[0] ? node.max_x : node.min_x,
+		wr.dir_is_neg[1] ? node.max_y : node.min_y,
+		wr.dir_is_neg[2] ? node.max_z : node.min_z };
+	const float* far_planes[3] = {
+		wr.dir_is_neg[0] ? node.min_x : node.max_x,
+		wr.dir_is_neg[1] ? node.min_y : node.max_y,
+		wr.dir_is_neg[2] ? node.min_z : node.max_z };
+
+	__m256 t0 = _mm256_set1_ps(t_min);
+	__m256 t1 = _mm256_set1_ps(t_max);
+	for (int a = 0; a < 3; ++a) {
+		__m256 o = _mm256_set1_ps(wr.origin[a]);
+		__m256 inv = _mm256_set1_ps(wr.inv_dir[a]);
+		__m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_planes[a]), o), inv);
+		__m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_planes[a]), o), inv);
+		t0 = _mm256_max_ps(n, t0);
+		t1 = _mm256_min_ps(f, t1);
+	}
+	_mm256_storeu_ps(t_near, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#elif defined(__SSE2__)
+// No AVX, so test the 8 children as two halves of 4.
+template <>
+inline int intersect_children<8>(const wide_bvh_node<8>& node, const wide_ray& wr, float t_min, float t_max, float* t_near) {
+	int mask = 0;
+	for (int half = 0; half < 8; half += 4) {
+		__m128 t0 = _mm_set1_ps(t_min);
+		__m128 t1 = _mm_set1_ps(t_max);
+		const float* near_planes[3] = {
+			(wr.dir_is_neg[0] ? node.max_x : node.min_x) + half,
+			(wr.dir_is_neg[1] ? node.max_y : node.min_y) + half,
+			(wr.dir_is_neg[2] ? node.max_z : node.min_z) + half };
+		const float* far_planes[3] = {
+			(wr.dir_is_neg[0] ? node.min_x : node.max_x) + half,
+			(wr.dir_is_neg[1] ? node.min_y : node.max_y) + half,
+			(wr.dir_is_neg[2] ? node.min_z : node.max_z) + half };
+		for (int a = 0; a < 3; ++a) {
+			__m128 o = _mm_set1_ps(wr.origin[a]);
+			__m128 inv = _mm_set1_ps(wr.inv_dir[a]);
+			__m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_planes[a]), o), inv);
+			__m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_planes[a]), o), inv);
+			t0 = _mm_max_ps(n, t0);
+			t1 = _mm_min_ps(f, t1);
+		}
+		_mm_storeu_ps(t_near + half, t0);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << half;
+	}
+	return mask;
+}
+#endif
+
+template <int N>
+class wide_bvh : public refittable_bvh {
+	public:
+		wide_bvh() {}
+		wide_bvh(const linear_bvh& binary);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+			output_box = bbox;
+			return !nodes.empty();
+		}
+
+		virtual void refit(double time0, double time1, int num_threads = 1) override;
+		virtual void refit_objects(double time0, double time1, const std::vector<uint32_t>& moved) override;
+		virtual double degradation() const override {
+			return nodes.empty() ? 1.0 : (cost_sum / bbox.surface_area()) / built_cost;
+		}
+
+	private:
+		uint32_t collapse(const linear_bvh& binary, uint32_t binary_index);
+		aabb refit_node(uint32_t index, double time0, double time1, int num_threads, double& cost);
+
+		// Unused slots are inside out, which no real box is.
+		static bool empty_child(const wide_bvh_node<N>& node, int i) { return node.min_x[i] > node.max_x[i]; }
+
+		static aabb child_box(const wide_bvh_node<N>& node, int i) {
+			return aabb(point3(node.min_x[i], node.min_y[i], node.min_z[i]), point3(node.max_x[i], node.max_y[i], node.max_z[i]));
+		}
+
+		static void set_child_box(wide_bvh_node<N>& node, int i, const aabb& box) {
+			node.min_x[i] = round_down(box.min().x());
+			node.min_y[i] = round_down(box.min().y());
+			node.min_z[i] = round_down(box.min().z());
+			node.max_x[i] = round_up(box.max().x());
+			node.max_y[i] = round_up(box.max().y());
+			node.max_z[i] = round_up(box.max().z());
+		}
+
+		// The box around all the children of a node.
+		static aabb node_bounds(const wide_bvh_node<N>& node) {
+			aabb box = aabb::empty();
+			for (int i = 0; i < N; ++i)
+				if (!empty_child(node, i))
+					box = surrounding_box(box, child_box(node, i));
+			return box;
+		}
+
+		// Same as node_cost in linear_bvh.h, per child.
+		static double child_cost(const wide_bvh_node<N>& node, int i) {
+			return child_box(node, i).surface_area() * (node.count[i] > 0 ? node.count[i] : sah_traversal_cost);
+		}
+
+	public:
+		std::vector<wide_bvh_node<N>> nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+		std::vector<uint32_t> object_slot;
+		std::vector<uint32_t> primitive_object;
+		aabb bbox;
+
+	private:
+		double cost_sum = 0;
+		double built_cost = 1;
+
+		// Where every node and primitive hangs in the tree, for refit_objects.
+		std::vector<uint32_t> parent_node;
+		std::vector<uint8_t> parent_child;
+		std::vector<uint32_t> leaf_node;
+		std::vector<uint8_t> leaf_child;
+};
+
+template <int N>
+wide_bvh<N>::wide_bvh(const linear_bvh& binary) {
+	if (binary.nodes.empty())
+		return;
+
+	primitives = binary.primitives;
+	object_slot = binary.object_slot;
+	primitive_object = binary.primitive_object;
+	binary.bounding_box(0, 0, bbox);
+	nodes.reserve(binary.nodes.size() / (N - 1) + 1);
+	collapse(binary, 0);
+
+	for (const wide_bvh_node<N>& node : nodes)
+		for (int i = 0; i < N; ++i)
+			if (!empty_child(node, i))
+				cost_sum += child_cost(node, i);
+	built_cost = cost_sum / bbox.surface_area();
+}
+
+template <int N>
+uint32_t wide_bvh<N>::collapse(const linear_bvh& binary, uint32_t binary_index) {
+	const auto& bnodes = binary.nodes;
+
+	auto area = [&](uint32_t i) {
+		const linear_bvh_node& n = bnodes[i];
+		double dx = n.box_max[0] - n.box_min[0];
+		double dy = n.box_max[1] - n.box_min[1];
+		double dz = n.box_max[2] - n.box_min[2];
+		return dx * dy + dy * dz + dz * dx;
+	};
+
+	// Gather up to N binary nodes to become the children of this wide node.
+	uint32_t children[N];
+	int num_children = 0;
+	if (bnodes[binary_index].count > 0) {
+		children[num_children++] = binary_index; // The whole tree is a single leaf
+	} else {
+		children[num_children++] = binary_index + 1;
+		children[num_children++] = bnodes[binary_index].second_child;
+	}
+
+	while (num_children < N) {
+		int biggest = -1;
+		double biggest_area = -1;
+		for (int i = 0; i < num_children; ++i) {
+			if (bnodes[children[i]].count == 0 && area(children[i]) > biggest_area) {
+				biggest = i;
+				biggest_area = area(children[i]);
+			}
+		}
+		if (biggest == -1)
+			break;
+
+		uint32_t open = children[biggest];
+		children[biggest] = open + 1;
+		children[num_children++] = bnodes[open].second_child;
+	}
+
+	uint32_t index = nodes.size();
+	nodes.emplace_back();
+	for (int i = 0; i < N; ++i) {
+		nodes[index].min_x[i] = nodes[index].min_y[i] = nodes[index].min_z[i] = std::numeric_limits<float>::infinity();
+		nodes[index].max_x[i] = nodes[index].max_y[i] = nodes[index].max_z[i] = -std::numeric_limits<float>::infinity();
+		nodes[index].offset[i] = 0;
+		nodes[index].count[i] = 0;
+	}
+
+	for (int i = 0; i < num_children; ++i) {
+		const linear_bvh_node& child = bnodes[children[i]];
+		uint32_t offset = (child.count > 0) ? child.first_primitive : collapse(binary, children[i]);
+
+		// NOTE :: collapse() can grow nodes, so look the node up again every time.
+		wide_bvh_node<N>& node = nodes[index];
+		node.min_x[i] = child.box_min[0];
+		node.min_y[i] = child.box_min[1];
+		node.min_z[i] = child.box_min[2];
+		node.max_x[i] = child.box_max[0];
+		node.max_y[i] = child.box_max[1];
+		node.max_z[i] = child.box_max[2];
+		node.offset[i] = offset;
+		node.count[i] = child.count;
+	}
+
+	return index;
+}
+
+template <int N>
+void wide_bvh<N>::refit(double time0, double time1, int num_threads) {
+	if (nodes.empty())
+		return;
+	if (primitives.size() < bvh_parallel_threshold)
+		num_threads = 1;
+
+	cost_sum = 0;
+	bbox = refit_node(0, time0, time1, num_threads, cost_sum);
+}
+
+// Refits the children of nodes[index], adds their cost to cost and returns the box around them.
+template <int N>
+aabb wide_bvh<N>::refit_node(uint32_t index, double time0, double time1, int num_threads, double& cost) {
+	wide_bvh_node<N>& node = nodes[index];
+
+	int interior = 0;
+	for (int i = 0; i < N; ++i)
+		if (!empty_child(node, i) && node.count[i] == 0)
+			++interior;
+
+	// The threads are shared out between the interior children, and the last one
+	// is refit on this thread.
+	int threads_each = (interior > 0) ? std::max(1, num_threads / interior) : 1;
+	aabb boxes[N];
+	double costs[N] = {};
+	task_group group;
+	for (int i = 0; i < N; ++i) {
+		if (empty_child(node, i))
+			continue;
+		if (node.count[i] > 0)
+			boxes[i] = primitives_box(primitives, node.offset[i], node.count[i], time0, time1);
+		else if (num_threads > 1 && --interior > 0)
+			group.run([this, &node, &boxes, &costs, i, time0, time1, threads_each]() {
+				boxes[i] = refit_node(node.offset[i], time0, time1, threads_each, costs[i]);
+			});
+		else
+			boxes[i] = refit_node(node.offset[i], time0, time1, threads_each, costs[i]);
+	}
+
+	group.wait();
+	for (int i = 0; i < N; ++i) {
+		if (empty_child(node, i))
+			continue;
+		set_child_box(node, i, boxes[i]);
+		cost += costs[i] + child_cost(node, i);
+	}
+	return node_bounds(node);
+}
+
+template <int N>
+void wide_bvh<N>::refit_objects(double time0, double time1, const std::vector<uint32_t>& moved) {
+	if (nodes.empty())
+		return;
+
+	// object_slot only knows one of the leaves of a duplicated object.
+	if (!primitive_object.empty()) {
+		refit(time0, time1);
+		return;
+	}
+
+	if (parent_node.empty()) {
+		parent_node.resize(nodes.size());
+		parent_child.resize(nodes.size());
+		leaf_node.resize(primitives.size());
+		leaf_child.resize(primitives.size());
+		for (uint32_t index = 0; index < nodes.size(); ++index) {
+			const wide_bvh_node<N>& node = nodes[index];
+			for (int i = 0; i < N; ++i) {
+				if (empty_child(node, i))
+					continue;
+				if (node.count[i] == 0) {
+					parent_node[node.offset[i]] = index;
+					parent_child[node.offset[i]] = i;
+				}
+				for (uint32_t j = node.offset[i]; j < node.offset[i] + node.count[i]; ++j) {
+					leaf_node[j] = index;
+					leaf_child[j] = i;
+				}
+			}
+		}
+	}
+
+	// Same as linear_bvh::refit_objects, except a node's box is stored in its parent.
+	for (uint32_t object : moved) {
+		uint32_t slot = object_slot[object];
+		uint32_t index = leaf_node[slot];
+		int child = leaf_child[slot];
+		while (true) {
+			wide_bvh_node<N>& node = nodes[index];
+			aabb old_box = child_box(node, child);
+			double old_cost = child_cost(node, child);
+			if (node.count[child] > 0)
+				set_child_box(node, child, primitives_box(primitives, node.offset[child], node.count[child], time0, time1));
+			else
+				set_child_box(node, child, node_bounds(nodes[node.offset[child]]));
+
+			if (same_box(child_box(node, child), old_box))
+				break;
+
+			cost_sum += child_cost(node, child) - old_cost;
+			if (index == 0) {
+				bbox = node_bounds(node);
+				break;
+			}
+			child = parent_child[index];
+			index = parent_node[index];
+		}
+	}
+}
+
+template <int N>
+bool wide_bvh<N>::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+	if (nodes.empty())
+		return false;
+
+	wide_ray wr(r);
+
+	struct entry {
+		uint32_t offset;
+		uint32_t count;
+		float t;
+	};
+	entry stack[bvh_max_depth * (N - 1) + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, static_cast<float>(t_min) };
+
+	bool hit_anything = false;
+	mailbox tested;
+	alignas(32) float t_near[N];
+	// Counted here and added to the stats once, instead of on every node.
+	uint64_t visits = 0;
+
+	while (stack_size > 0) {
+		entry e = stack[--stack_size];
+		if (e.t > t_max)
+			continue;
+		++visits;
+
+		if (e.count > 0) {
+			for (uint32_t i = e.offset; i < e.offset + e.count; ++i) {
+				if (!primitive_object.empty() && tested.seen(primitive_object[i]))
+					continue;
+				if (primitives[i]->hit(r, t_min, t_max, rec)) {
+					hit_anything = true;
+					t_max = rec.t;
+				}
+			}
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = nodes[e.offset];
+		int mask = intersect_children<N>(node, wr, static_cast<float>(t_min), static_cast<float>(t_max) * wide_t_max_pad, t_near);
+		if (mask == 0)
+			continue;
+
+		// Push the hit children so the nearest one ends up on top of the stack.
+		int first = stack_size;
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			entry child = { node.offset[i], node.count[i], t_near[i] };
+			int j = stack_size++;
+			while (j > first && stack[j - 1].t < child.t) {
+				stack[j] = stack[j - 1];
+				--j;
+			}
+			stack[j] = child;
+		}
+	}
+
+	COUNT_STAT(node_visits, visits);
+	return hit_anything;
+}
+
+// Any hit will do, so the children are pushed in any order and it returns at the first hit.
+template <int N>
+bool wide_bvh<N>::occluded(const ray& r, double t_min, double t_max) const {
+	if (nodes.empty())
+		return false;
+
+	wide_ray wr(r);
+
+	struct entry {
+		uint32_t offset;
+		uint32_t count;
+	};
+	entry stack[bvh_max_depth * (N - 1) + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0 };
+
+	alignas(32) float t_near[N];
+	const float t_lo = static_cast<float>(t_min);
+	const float t_hi = static_cast<float>(t_max) * wide_t_max_pad;
+	uint64_t visits = 0;
+
+	while (stack_size > 0) {
+		entry e = stack[--stack_size];
+		++visits;
+		if (e.count > 0) {
+			for (uint32_t i = e.offset; i < e.offset + e.count; ++i) {
+				if (primitives[i]->occluded(r, t_min, t_max)) {
+					COUNT_STAT(node_visits, visits);
+					return true;
+				}
+			}
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = nodes[e.offset];
+		int mask = intersect_children<N>(node, wr, t_lo, t_hi, t_near);
+		while (mask) {
+			int i = __builtin_ctz(mask);
+			mask &= mask - 1;
+			stack[stack_size++] = { node.offset[i], node.count[i] };
+		}
+	}
+
+	COUNT_STAT(node_visits, visits);
+	return false;
+}
+
+#endif